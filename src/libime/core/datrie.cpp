@@ -283,7 +283,9 @@ public:
 
         auto to = pos.index;
         if (const int offset = pos.offset) {
-            size_t len_tail = std::strlen(&m_tail[-m_array[to].base]);
+            // The part of tail before offset, pos may be in the middle of the
+            // tail if it comes from traverse.
+            size_t len_tail = offset + m_array[to].base;
             if (len > len_tail) {
                 len -= len_tail;
             } else {
@@ -311,6 +313,38 @@ public:
         return d.result_value;
     }
 
+    uint64_t childMask(npos_t npos, const uchar first) const {
+        uint64_t mask = 0;
+        auto addLabel = [&mask, first](const uchar label) {
+            if (label && label >= first && label - first < 64) {
+                mask |= 1ULL << (label - first);
+            }
+        };
+        const auto from = npos.index;
+        if (npos.offset) { // on tail, only the next tail char may follow
+            addLabel(static_cast<uchar>(m_tail[npos.offset]));
+            return mask;
+        }
+        const int base = m_array[from].base;
+        if (base < 0) {
+            addLabel(static_cast<uchar>(m_tail[-base]));
+            return mask;
+        }
+        // Walk the sibling chain of the children, label 0 is the value (or
+        // the dummy child of the root) and is never part of the mask.
+        uchar c = m_ninfo[from].child;
+        do {
+            if (ORDERED && c >= first + 64) {
+                break;
+            }
+            if (c && m_array[base ^ c].check == static_cast<int>(from)) {
+                addLabel(c);
+            }
+            c = m_ninfo[base ^ c].sibling;
+        } while (c);
+        return mask;
+    }
+
     template <typename U>
     inline void update(const char *key, U &&callback) {
         update(key, std::strlen(key),
@@ -1068,6 +1102,12 @@ typename DATrie<T>::value_type DATrie<T>::traverse(const char *key, size_t len,
     return result;
 }
 
+template <typename T>
+uint64_t DATrie<T>::childMask(position_type pos, char first) const {
+    return d->childMask(typename DATriePrivate<T>::npos_t(pos),
+                        static_cast<uint8_t>(first));
+}
+
 template <typename T>
 void DATrie<T>::clear() {
     d->clear();
@@ -71,7 +71,8 @@ public:
 
     size_t size() const;
 
-    // retrive the string via len and pos
+    // retrive the string via len and pos, pos may be any position returned by
+    // traverse or foreach.
     void suffix(std::string &s, size_t len, position_type pos) const;
 
     // result will be NO_VALUE
@@ -87,6 +88,10 @@ public:
     DATrie<T>::value_type traverse(const char *key, size_t len,
                                    position_type &from) const;
 
+    // Return the characters in [first, first + 64) that can be traversed from
+    // pos. Bit i of the result is set if character first + i has a path.
+    uint64_t childMask(position_type pos, char first) const;
+
     // set value
     void set(std::string_view key, value_type val) {
         return set(key.data(), key.size(), val);
@@ -220,6 +220,9 @@ void DecoderPrivate::backwardSearch(const SegmentGraph &graph, Lattice &l,
             q, result;
         std::unordered_set<std::string> dup;
         std::list<NBestNode> nbestNodePool;
+        // A lattice node is expanded once for every partial path that reaches
+        // it, so keep the score of its incoming edges for the next expansion.
+        std::unordered_map<const LatticeNode *, std::vector<float>> edgeScores;
 
         auto eos = &lattice[nullptr][0];
         auto newNBestNode = [&nbestNodePool](const LatticeNode *node) {
@@ -246,10 +249,19 @@ void DecoderPrivate::backwardSearch(const SegmentGraph &graph, Lattice &l,
                 }
                 dup.insert(sentence);
             } else {
-                for (auto &from : lattice[node->node_->from()]) {
-                    auto score =
-                        model_->score(from.state(), *node->node_, state) +
-                        node->node_->cost();
+                auto &froms = lattice[node->node_->from()];
+                auto &scores = edgeScores[node->node_];
+                if (scores.empty()) {
+                    scores.reserve(froms.size());
+                    for (auto &from : froms) {
+                        scores.push_back(
+                            model_->score(from.state(), *node->node_, state) +
+                            node->node_->cost());
+                    }
+                }
+                for (size_t i = 0, e = froms.size(); i < e; i++) {
+                    auto &from = froms[i];
+                    auto score = scores[i];
                     if (&from != bos && score < min)
                         continue;
                     auto parent = newNBestNode(&from);
@@ -7,381 +7,1674 @@
 #include "constants.h"
 #include "datrie.h"
 #include "utils.h"
-#include <boost/algorithm/cxx11/all_of.hpp>
+#include <algorithm>
+#include <atomic>
 #include <boost/algorithm/string.hpp>
 #include <boost/range/adaptor/reversed.hpp>
-#include <boost/range/adaptor/transformed.hpp>
 #include <boost/range/algorithm.hpp>
 #include <cmath>
 #include <fcitx-utils/log.h>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 
 namespace libime {
 
 static constexpr uint32_t historyBinaryFormatMagic = 0x000fc315;
-static constexpr uint32_t historyBinaryFormatVersion = 0x2;
+static constexpr uint32_t historyBinaryFormatVersion = 0x3;
+// Last version that only contains sentences, and is loaded by replaying them.
+static constexpr uint32_t historyReplayFormatVersion = 0x2;
+// History saved with time decayed counts instead of pools.
+static constexpr uint32_t historyDecayedFormatVersion = 0x4;
+static constexpr uint32_t historyLogFormatMagic = 0x000fc316;
+static constexpr uint32_t historyLogFormatVersion = 0x1;
+// Changes kept for saveLog before falling back to save.
+static constexpr size_t historyLogMaxSize = 8192;
+
+enum class HistoryLogType : uint8_t { Add, Forget, Clear };
+
+// A change to history not yet written by saveLog.
+struct HistoryLogRecord {
+    HistoryLogType type_;
+    std::vector<std::string> words_;
+};
+
+static constexpr std::array<size_t, 3> historyPoolSize = {128, 8192, 65536};
+
+using PoolWeight = std::array<float, historyPoolSize.size()>;
+using PoolCount = std::array<int32_t, historyPoolSize.size()>;
+
+// We define the frequency as following.
+// (1 - p) the frequency belongs to first pool.
+// p * (1 - p) Second pool
+// p^2 * (1 - p) Third pool
+// ...
+// p^(n-1) n-th pool.
+// In sum, it's (1-p) * p^(i - 1)
+// And then we define alpha as p = 1 / (1 + alpha).
+static PoolWeight historyPoolWeight() {
+    const float p = 1.0 / (1 + HISTORY_BIGRAM_ALPHA_VALUE);
+    PoolWeight weight;
+    for (size_t i = 0; i < historyPoolSize.size(); i++) {
+        float portion = 1.0f;
+        if (i + 1 != historyPoolSize.size()) {
+            portion *= 1 - p;
+        }
+        portion *= std::pow(p, i);
+        weight[i] = portion / historyPoolSize[i];
+    }
+    return weight;
+}
 
-struct WeightedTrie {
-    using TrieType = DATrie<int32_t>;
+// Key of an n-gram, which is the words joined by '|'. The key is built in buf.
+static std::string_view ngramKey(std::string &buf, std::string_view s1,
+                                 std::string_view s2) {
+    buf.assign(s1.data(), s1.size());
+    buf += '|';
+    buf.append(s2.data(), s2.size());
+    return buf;
+}
 
+static std::string_view ngramKey(std::string &buf, std::string_view s1,
+                                 std::string_view s2, std::string_view s3) {
+    ngramKey(buf, s1, s2);
+    buf += '|';
+    buf.append(s3.data(), s3.size());
+    return buf;
+}
+
+// Whether word is one of the words of an n-gram key.
+static bool ngramKeyContains(std::string_view key, std::string_view word) {
+    size_t start = 0;
+    while (true) {
+        auto end = key.find('|', start);
+        if (key.substr(start, end - start) == word) {
+            return true;
+        }
+        if (end == std::string_view::npos) {
+            return false;
+        }
+        start = end + 1;
+    }
+}
+
+// Call callback(order, key) with every n-gram counted for a sentence, where
+// order is 1 for unigram. The sentence boundaries are included, and the first
+// trigram starts with "<s>".
+template <typename R, typename Callback>
+void foreachNgramKey(const R &sentence, bool trigram, std::string &buf,
+                     Callback callback) {
+    std::string_view prev = "<s>";
+    for (auto iter = sentence.begin(), end = sentence.end(); iter != end;
+         iter++) {
+        callback(1, *iter);
+        auto next = std::next(iter);
+        if (next != end) {
+            callback(2, ngramKey(buf, *iter, *next));
+            if (trigram) {
+                callback(3, ngramKey(buf, prev, *iter, *next));
+            }
+        }
+        prev = *iter;
+    }
+    callback(1, "<s>");
+    callback(1, "</s>");
+    callback(2, ngramKey(buf, "<s>", *sentence.begin()));
+    callback(2, ngramKey(buf, *std::prev(sentence.end()), "</s>"));
+}
+
+using ImportSentences = std::vector<const std::vector<std::string> *>;
+// Counts of unigram, bigram and trigram.
+template <typename Count>
+using NgramCounts = std::array<std::unordered_map<std::string, Count>, 3>;
+
+// Decayed count, along with the part added after the last prune.
+struct DecayedCount {
+    double count_ = 0;
+    double recent_ = 0;
+};
+
+static void addCount(DecayedCount &count, const DecayedCount &delta) {
+    count.count_ += delta.count_;
+    count.recent_ += delta.recent_;
+}
+
+static void addCount(PoolCount &count, const PoolCount &delta) {
+    for (size_t i = 0; i < count.size(); i++) {
+        count[i] += delta[i];
+    }
+}
+
+// Count the n-grams of sentences, each sentence adds weight(i) to the count of
+// its n-grams. The sentences are split between threads, which count their
+// part on their own, and the counts are merged at the end.
+template <typename Count, typename Weight>
+NgramCounts<Count> countNgrams(const ImportSentences &sentences, bool trigram,
+                               size_t threads, Weight weight) {
+    if (!threads) {
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    threads = std::max<size_t>(std::min(threads, sentences.size()), 1);
+    std::vector<NgramCounts<Count>> counts(threads);
+    auto countPart = [&sentences, &counts, trigram, threads,
+                      &weight](size_t part) {
+        auto &result = counts[part];
+        std::string buf;
+        std::string key;
+        const auto begin = sentences.size() * part / threads;
+        const auto end = sentences.size() * (part + 1) / threads;
+        for (auto i = begin; i < end; i++) {
+            const auto delta = weight(i);
+            foreachNgramKey(*sentences[i], trigram, buf,
+                            [&result, &key, &delta](size_t order,
+                                                    std::string_view ngram) {
+                                key.assign(ngram.data(), ngram.size());
+                                addCount(result[order - 1][key], delta);
+                            });
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t part = 1; part < threads; part++) {
+        workers.emplace_back(countPart, part);
+    }
+    countPart(0);
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    // Each order is merged by its own thread.
+    auto mergeOrder = [&counts](size_t order) {
+        auto &merged = counts[0][order];
+        for (size_t part = 1; part < counts.size(); part++) {
+            for (const auto &item : counts[part][order]) {
+                addCount(merged[item.first], item.second);
+            }
+            counts[part][order].clear();
+        }
+    };
+    workers.clear();
+    if (threads > 1) {
+        for (size_t order = 1; order < counts[0].size(); order++) {
+            workers.emplace_back(mergeOrder, order);
+        }
+        mergeOrder(0);
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    return std::move(counts[0]);
+}
+
+// A trie from key to an entry of history data. Erased entries are reused.
+template <typename Entry>
+class HistoryTrie {
 public:
-    WeightedTrie() = default;
+    using TrieType = DATrie<uint32_t>;
+    using position_type = TrieType::position_type;
+
+    void clear() {
+        trie_.clear();
+        entries_.clear();
+        freeEntries_.clear();
+    }
 
-    void clear() { trie_.clear(); }
+    void swap(HistoryTrie &other) {
+        std::swap(trie_, other.trie_);
+        std::swap(entries_, other.entries_);
+        std::swap(freeEntries_, other.freeEntries_);
+    }
+
+    // loadEntry(in, entry) reads the data of an entry.
+    template <typename LoadEntry>
+    void load(std::istream &in, LoadEntry loadEntry) {
+        clear();
+        trie_.load(in);
+        uint32_t size = 0;
+        throw_if_io_fail(unmarshall(in, size));
+        entries_.resize(size);
+        for (auto &entry : entries_) {
+            loadEntry(in, entry);
+        }
+        std::vector<TrieType::value_type> values;
+        trie_.dump(values);
+        std::vector<bool> used(size);
+        for (auto v : values) {
+            if (v >= size) {
+                throw std::invalid_argument("Invalid history entry.");
+            }
+            used[v] = true;
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            if (!used[i]) {
+                entries_[i] = Entry();
+                freeEntries_.push_back(i);
+            }
+        }
+    }
 
-    const TrieType &trie() const { return trie_; }
+    // saveEntry(out, entry) writes the data of an entry.
+    template <typename SaveEntry>
+    void save(std::ostream &out, SaveEntry saveEntry) {
+        trie_.save(out);
+        throw_if_io_fail(marshall(out, static_cast<uint32_t>(entries_.size())));
+        for (const auto &entry : entries_) {
+            saveEntry(out, entry);
+        }
+    }
+
+    size_t size() const { return entries_.size() - freeEntries_.size(); }
+
+    const Entry *find(std::string_view s) const {
+        auto v = trie_.exactMatchSearch(s.data(), s.size());
+        if (!TrieType::isValid(v)) {
+            return nullptr;
+        }
+        return &entries_[v];
+    }
+
+    Entry *find(std::string_view s) {
+        return const_cast<Entry *>(std::as_const(*this).find(s));
+    }
+
+    // Look up the key continues from a position returned by prefix().
+    const Entry *find(position_type pos, std::string_view s) const {
+        if (!pos) {
+            return nullptr;
+        }
+        auto v = trie_.traverse(s, pos);
+        if (!TrieType::isValid(v)) {
+            return nullptr;
+        }
+        return &entries_[v];
+    }
 
-    int32_t weightedSize() const { return weightedSize_; }
+    Entry &findOrAdd(std::string_view s) {
+        auto v = trie_.exactMatchSearch(s.data(), s.size());
+        if (!TrieType::isValid(v)) {
+            if (freeEntries_.empty()) {
+                v = entries_.size();
+                entries_.emplace_back();
+            } else {
+                v = freeEntries_.back();
+                freeEntries_.pop_back();
+            }
+            trie_.set(s.data(), s.size(), v);
+        }
+        return entries_[v];
+    }
 
-    int32_t freq(std::string_view s) const {
+    void erase(std::string_view s) {
         auto v = trie_.exactMatchSearch(s.data(), s.size());
-        if (trie_.isNoValue(v)) {
+        if (!TrieType::isValid(v)) {
+            return;
+        }
+        trie_.erase(s.data(), s.size());
+        entries_[v] = Entry();
+        freeEntries_.push_back(v);
+    }
+
+    // Call callback(key, entry) with each key.
+    template <typename Callback>
+    void foreach(Callback callback) const {
+        std::string buf;
+        trie_.foreach([this, &buf, &callback](TrieType::value_type v,
+                                              size_t len, position_type pos) {
+            trie_.suffix(buf, len, pos);
+            callback(std::string_view(buf), entries_[v]);
+            return true;
+        });
+    }
+
+    // Erase all keys that callback(key, entry) returns true.
+    template <typename Callback>
+    void eraseIf(Callback callback) {
+        std::vector<std::string> keys;
+        foreach([&keys, &callback](std::string_view key, const Entry &entry) {
+            if (callback(key, entry)) {
+                keys.emplace_back(key);
+            }
+        });
+        for (const auto &key : keys) {
+            erase(key);
+        }
+    }
+
+    void fillPredict(std::unordered_set<std::string> &words,
+                     std::string_view word, size_t maxSize) const {
+        trie_.foreach(word,
+                      [this, &words, maxSize](TrieType::value_type, size_t len,
+                                              position_type pos) {
+                          std::string buf;
+                          trie_.suffix(buf, len, pos);
+                          // Skip special word.
+                          if (buf == "<s>" || buf == "</s>") {
+                              return true;
+                          }
+                          words.emplace(std::move(buf));
+
+                          if (maxSize > 0 && words.size() >= maxSize) {
+                              return false;
+                          }
+                          return true;
+                      });
+    }
+
+    // Position after "prev|", or 0 if there is no such key.
+    position_type prefix(std::string_view prev) const {
+        position_type pos = 0;
+        if (TrieType::isNoPath(trie_.traverse(prev, pos)) ||
+            TrieType::isNoPath(trie_.traverse("|", pos))) {
             return 0;
         }
-        return v;
+        return pos;
+    }
+
+    // Continue a position returned by prefix() with "prev|", or 0 if there
+    // is no such key.
+    position_type prefix(position_type pos, std::string_view prev) const {
+        if (!pos || TrieType::isNoPath(trie_.traverse(prev, pos)) ||
+            TrieType::isNoPath(trie_.traverse("|", pos))) {
+            return 0;
+        }
+        return pos;
+    }
+
+    // Call callback with each word after "prev|", buf holds the word.
+    void foreachPredict(
+        std::string_view prev, std::string &buf,
+        const std::function<bool(std::string_view)> &callback) const {
+        position_type pos = 0;
+        if (TrieType::isNoPath(trie_.traverse(prev, pos))) {
+            return;
+        }
+        trie_.foreach(
+            "|",
+            [this, &buf, &callback](TrieType::value_type, size_t len,
+                                    position_type pos) {
+                trie_.suffix(buf, len, pos);
+                // Skip special word.
+                if (buf == "<s>" || buf == "</s>") {
+                    return true;
+                }
+                return callback(buf);
+            },
+            pos);
+    }
+
+private:
+    TrieType trie_;
+    std::vector<Entry> entries_;
+    std::vector<uint32_t> freeEntries_;
+};
+
+struct WeightedEntry {
+    PoolCount count_ = {};
+    float freq_ = 0;
+};
+
+// A trie shared by all pools. Each key maps to its count in every pool, along
+// with the weighted sum of them, so a lookup is a single walk of the trie.
+class WeightedTrie : public HistoryTrie<WeightedEntry> {
+public:
+    explicit WeightedTrie(const PoolWeight &weight) : weight_(weight) {}
+
+    void load(std::istream &in) {
+        HistoryTrie::load(in, [this](std::istream &in, WeightedEntry &entry) {
+            for (auto &count : entry.count_) {
+                throw_if_io_fail(unmarshall(in, count));
+            }
+            updateFreq(entry);
+        });
+    }
+
+    void save(std::ostream &out) {
+        HistoryTrie::save(out,
+                          [](std::ostream &out, const WeightedEntry &entry) {
+                              for (auto count : entry.count_) {
+                                  throw_if_io_fail(marshall(out, count));
+                              }
+                          });
+    }
+
+    float freq(std::string_view s) const {
+        const auto *entry = find(s);
+        return entry ? entry->freq_ : 0;
+    }
+
+    // Frequency of the key continues from a position returned by prefix().
+    float freq(position_type pos, std::string_view s) const {
+        const auto *entry = find(pos, s);
+        return entry ? entry->freq_ : 0;
+    }
+
+    void incFreq(size_t pool, std::string_view s, int32_t delta) {
+        auto &entry = findOrAdd(s);
+        entry.count_[pool] += delta;
+        updateFreq(entry);
+    }
+
+    void decFreq(size_t pool, std::string_view s, int32_t delta) {
+        auto *entry = find(s);
+        if (!entry) {
+            return;
+        }
+        entry->count_[pool] = std::max(entry->count_[pool] - delta, 0);
+        if (std::all_of(entry->count_.begin(), entry->count_.end(),
+                        [](int32_t count) { return count == 0; })) {
+            erase(s);
+        } else {
+            updateFreq(*entry);
+        }
+    }
+
+    // Same as decFreq(from, ...) followed by incFreq(to, ...), with a single
+    // lookup.
+    void moveFreq(size_t from, size_t to, std::string_view s, int32_t delta) {
+        auto &entry = findOrAdd(s);
+        entry.count_[from] = std::max(entry.count_[from] - delta, 0);
+        entry.count_[to] += delta;
+        updateFreq(entry);
+    }
+
+private:
+    void updateFreq(WeightedEntry &entry) const {
+        float freq = 0;
+        for (size_t i = 0; i < entry.count_.size(); i++) {
+            freq += entry.count_[i] * weight_[i];
+        }
+        entry.freq_ = freq;
+    }
+
+    const PoolWeight weight_;
+};
+
+struct DecayedEntry {
+    float count_ = 0;
+    uint32_t time_ = 0;
+};
+
+// History that keeps one count per n-gram, which is halved every halfLife
+// sentences. An entry holds the count at the last time it is updated, and is
+// decayed to the current time when it is read. The time is the number of
+// sentences added.
+class DecayedHistory {
+public:
+    using position_type = HistoryTrie<DecayedEntry>::position_type;
+
+    bool enabled() const { return halfLife_ != 0; }
+
+    uint32_t halfLife() const { return halfLife_; }
+
+    // Counts are kept, only the rate of decay from now on is changed.
+    void setHalfLife(uint32_t halfLife) {
+        halfLife_ = halfLife;
+        if (!enabled()) {
+            clear();
+        }
+    }
+
+    bool useTrigram() const { return useTrigram_; }
+
+    // Trigrams are counted from now on.
+    void setUseTrigram(bool useTrigram) {
+        if (useTrigram_ == useTrigram) {
+            return;
+        }
+        useTrigram_ = useTrigram;
+        trigram_.clear();
+    }
+
+    void clear() {
+        unigram_.clear();
+        bigram_.clear();
+        trigram_.clear();
+        time_ = 0;
+    }
+
+    void load(std::istream &in) {
+        clear();
+        uint32_t halfLife = 0;
+        throw_if_io_fail(unmarshall(in, halfLife));
+        if (!halfLife) {
+            throw std::invalid_argument("Invalid history half life.");
+        }
+        halfLife_ = halfLife;
+        throw_if_io_fail(unmarshall(in, time_));
+        auto loadEntry = [](std::istream &in, DecayedEntry &entry) {
+            throw_if_io_fail(unmarshall(in, entry.count_));
+            throw_if_io_fail(unmarshall(in, entry.time_));
+        };
+        unigram_.load(in, loadEntry);
+        bigram_.load(in, loadEntry);
+        uint8_t hasTrigram = 0;
+        throw_if_io_fail(unmarshall(in, hasTrigram));
+        if (hasTrigram) {
+            trigram_.load(in, loadEntry);
+        }
+        if (!useTrigram_) {
+            trigram_.clear();
+        }
+    }
+
+    void save(std::ostream &out) {
+        throw_if_io_fail(marshall(out, halfLife_));
+        throw_if_io_fail(marshall(out, time_));
+        auto saveEntry = [](std::ostream &out, const DecayedEntry &entry) {
+            throw_if_io_fail(marshall(out, entry.count_));
+            throw_if_io_fail(marshall(out, entry.time_));
+        };
+        unigram_.save(out, saveEntry);
+        bigram_.save(out, saveEntry);
+        throw_if_io_fail(marshall(out, static_cast<uint8_t>(useTrigram_)));
+        if (useTrigram_) {
+            trigram_.save(out, saveEntry);
+        }
+    }
+
+    void dump(std::ostream &out) const {
+        unigram_.foreach(
+            [this, &out](std::string_view word, const DecayedEntry &entry) {
+                out << word << " " << count(entry) << std::endl;
+            });
+    }
+
+    // The sum of sentence counts once history is long enough, which is the
+    // limit of sum(0.5^(i / halfLife)).
+    float size() const { return 1 / (1 - std::exp2(-1.0f / halfLife_)); }
+
+    template <typename R>
+    void add(const R &sentence) {
+        time_++;
+        const std::array<HistoryTrie<DecayedEntry> *, 3> tries = {
+            &unigram_, &bigram_, &trigram_};
+        foreachNgramKey(sentence, useTrigram_, key_,
+                        [this, &tries](size_t order, std::string_view key) {
+                            inc(*tries[order - 1], key);
+                        });
+
+        if (time_ % halfLife_ == 0) {
+            prune();
+        }
+    }
+
+    // Same as clear followed by add of each sentence, up to rounding. The
+    // count of a sentence decays from the time it would be added. Only the
+    // last prune is applied, the ones before it would drop much less.
+    void loadSentences(ImportSentences sentences, size_t threads) {
+        clear();
+        time_ = sentences.size();
+        // Sentences so old that all of them add up to less than 1/16 of the
+        // prune threshold are skipped.
+        const auto maxAge = static_cast<double>(halfLife_) *
+                            (14 + std::log2(halfLife_ / std::log(2.0)));
+        const auto skip = static_cast<size_t>(
+            std::max(static_cast<double>(time_) - maxAge, 0.0));
+        sentences.erase(sentences.begin(), sentences.begin() + skip);
+        const auto lastPrune = time_ - time_ % halfLife_;
+        auto counts = countNgrams<DecayedCount>(
+            sentences, useTrigram_, threads,
+            [this, lastPrune, skip](size_t i) {
+                const auto time = skip + i + 1;
+                const auto count =
+                    std::exp2(-static_cast<double>(time_ - time) / halfLife_);
+                return DecayedCount{count, time > lastPrune ? count : 0};
+            });
+        const auto sinceLastPrune =
+            std::exp2(static_cast<double>(time_ - lastPrune) / halfLife_);
+        const std::array<HistoryTrie<DecayedEntry> *, 3> tries = {
+            &unigram_, &bigram_, &trigram_};
+        for (size_t order = 0; order < counts.size(); order++) {
+            for (const auto &item : counts[order]) {
+                auto count = item.second.count_;
+                if ((count - item.second.recent_) * sinceLastPrune <
+                    pruneThreshold) {
+                    count = item.second.recent_;
+                }
+                if (count <= 0) {
+                    continue;
+                }
+                auto &entry = tries[order]->findOrAdd(item.first);
+                entry.count_ = count;
+                entry.time_ = time_;
+            }
+        }
+    }
+
+    void forget(std::string_view word) {
+        unigram_.erase(word);
+        auto contains = [word](std::string_view key, const DecayedEntry &) {
+            return ngramKeyContains(key, word);
+        };
+        bigram_.eraseIf(contains);
+        trigram_.eraseIf(contains);
+    }
+
+    float unigramFreq(std::string_view word) const {
+        const auto *entry = unigram_.find(word);
+        return entry ? count(*entry) : 0;
+    }
+
+    position_type bigramPrefix(std::string_view prev) const {
+        return bigram_.prefix(prev);
+    }
+
+    float bigramFreq(position_type pos, std::string_view cur) const {
+        const auto *entry = bigram_.find(pos, cur);
+        return entry ? count(*entry) : 0;
+    }
+
+    position_type trigramPrefix(std::string_view prev) const {
+        return trigram_.prefix(prev);
+    }
+
+    position_type trigramPrefix(position_type pos,
+                                std::string_view prev) const {
+        return trigram_.prefix(pos, prev);
+    }
+
+    float trigramFreq(position_type pos, std::string_view cur) const {
+        const auto *entry = trigram_.find(pos, cur);
+        return entry ? count(*entry) : 0;
+    }
+
+    const HistoryTrie<DecayedEntry> &bigram() const { return bigram_; }
+
+private:
+    float count(const DecayedEntry &entry) const {
+        return entry.count_ *
+               std::exp2(-static_cast<float>(time_ - entry.time_) / halfLife_);
+    }
+
+    void inc(HistoryTrie<DecayedEntry> &trie, std::string_view key) {
+        auto &entry = trie.findOrAdd(key);
+        entry.count_ = count(entry) + 1;
+        entry.time_ = time_;
+    }
+
+    // Drop the n-grams not seen for about ten half lives. An n-gram is never
+    // counted more than the unigram of its first word, so they are dropped
+    // no later than the unigram.
+    void prune() {
+        auto isStale = [this](std::string_view, const DecayedEntry &entry) {
+            return count(entry) < pruneThreshold;
+        };
+        unigram_.eraseIf(isStale);
+        bigram_.eraseIf(isStale);
+        trigram_.eraseIf(isStale);
+    }
+
+    static constexpr float pruneThreshold = 1.0f / 1024;
+
+    uint32_t halfLife_ = 0;
+    uint32_t time_ = 0;
+    bool useTrigram_ = false;
+    HistoryTrie<DecayedEntry> unigram_;
+    HistoryTrie<DecayedEntry> bigram_;
+    HistoryTrie<DecayedEntry> trigram_;
+    // Reused buffer for n-gram key.
+    std::string key_;
+};
+
+// Words in history, so sentences can be stored as ids. The reference count of
+// a word is the number of its occurrences in all pools, the word is released
+// when it drops to zero.
+class HistoryWordTable {
+public:
+    using TrieType = DATrie<uint32_t>;
+
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    void clear() {
+        index_.clear();
+        words_.clear();
+        ref_.clear();
+        freeIds_.clear();
+    }
+
+    uint32_t find(std::string_view word) const {
+        auto v = index_.exactMatchSearch(word.data(), word.size());
+        if (!TrieType::isValid(v)) {
+            return npos;
+        }
+        return v;
+    }
+
+    uint32_t ref(std::string_view word) {
+        auto id = find(word);
+        if (id == npos) {
+            if (freeIds_.empty()) {
+                id = words_.size();
+                words_.emplace_back();
+                ref_.push_back(0);
+            } else {
+                id = freeIds_.back();
+                freeIds_.pop_back();
+            }
+            words_[id] = word;
+            index_.set(word.data(), word.size(), id);
+        }
+        ref_[id]++;
+        return id;
+    }
+
+    void unref(uint32_t id) {
+        if (--ref_[id] == 0) {
+            index_.erase(words_[id]);
+            words_[id].clear();
+            freeIds_.push_back(id);
+        }
+    }
+
+    const std::string &word(uint32_t id) const { return words_[id]; }
+
+    // References are not saved, they are restored by addRef from the
+    // sentences after load.
+    void load(std::istream &in) {
+        clear();
+        index_.load(in);
+        uint32_t size = 0;
+        throw_if_io_fail(unmarshall(in, size));
+        words_.resize(size);
+        for (auto &word : words_) {
+            throw_if_io_fail(unmarshallString(in, word));
+        }
+        ref_.assign(size, 0);
+    }
+
+    void save(std::ostream &out) {
+        index_.save(out);
+        throw_if_io_fail(marshall(out, static_cast<uint32_t>(words_.size())));
+        for (const auto &word : words_) {
+            throw_if_io_fail(marshallString(out, word));
+        }
+    }
+
+    void addRef(uint32_t id) {
+        if (id >= ref_.size()) {
+            throw std::invalid_argument("Invalid history word.");
+        }
+        ref_[id]++;
+    }
+
+    // Release the words that are not referenced after load.
+    void finishLoad() {
+        for (uint32_t id = 0; id < words_.size(); id++) {
+            if (ref_[id] == 0) {
+                if (!words_[id].empty()) {
+                    index_.erase(words_[id]);
+                    words_[id].clear();
+                }
+                freeIds_.push_back(id);
+            }
+        }
+    }
+
+private:
+    TrieType index_;
+    std::vector<std::string> words_;
+    std::vector<uint32_t> ref_;
+    std::vector<uint32_t> freeIds_;
+};
+
+struct HistorySentenceWord {
+    uint32_t id_;
+    // Position of this word in the inverted index of the pool.
+    uint32_t posting_;
+};
+
+using HistorySentence = std::vector<HistorySentenceWord>;
+
+// The sentences of a pool, from new to old. The frequencies are kept in the
+// shared tries.
+//
+// Sentences are kept in a fixed number of slots linked in the order of
+// recency, and each word id maps to the slots that contain it. Adding,
+// evicting or forgetting a sentence only touches that sentence.
+class HistoryBigramPool {
+public:
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    HistoryBigramPool(size_t maxSize) : maxSize_(maxSize) {}
+
+    // Call callback with each sentence, from old to new.
+    template <typename Callback>
+    void foreach(Callback callback) const {
+        for (auto slot = tail_; slot != npos; slot = slots_[slot].newer_) {
+            callback(slots_[slot].sentence_);
+        }
+    }
+
+    // Save the sentences as word ids, from old to new.
+    void saveIds(std::ostream &out) const {
+        throw_if_io_fail(marshall(out, static_cast<uint32_t>(size_)));
+        for (auto slot = tail_; slot != npos; slot = slots_[slot].newer_) {
+            const auto &sentence = slots_[slot].sentence_;
+            throw_if_io_fail(
+                marshall(out, static_cast<uint32_t>(sentence.size())));
+            for (const auto &word : sentence) {
+                throw_if_io_fail(marshall(out, word.id_));
+            }
+        }
+    }
+
+    void loadIds(std::istream &in, HistoryWordTable &words) {
+        clear();
+        uint32_t count = 0;
+        throw_if_io_fail(unmarshall(in, count));
+        if (count > maxSize_) {
+            throw std::invalid_argument("Invalid history pool size.");
+        }
+        while (count--) {
+            uint32_t size = 0;
+            throw_if_io_fail(unmarshall(in, size));
+            HistorySentence sentence(size);
+            for (auto &word : sentence) {
+                throw_if_io_fail(unmarshall(in, word.id_));
+                words.addRef(word.id_);
+            }
+            add(std::move(sentence));
+        }
+    }
+
+    void dump(std::ostream &out, const HistoryWordTable &words) const {
+        for (auto slot = head_; slot != npos; slot = slots_[slot].older_) {
+            bool first = true;
+            for (const auto &word : slots_[slot].sentence_) {
+                if (first) {
+                    first = false;
+                } else {
+                    out << " ";
+                }
+                out << words.word(word.id_);
+            }
+            out << std::endl;
+        }
+    }
+
+    void clear() {
+        slots_.clear();
+        freeSlots_.clear();
+        index_.clear();
+        head_ = tail_ = npos;
+        size_ = 0;
+    }
+
+    // Add sentence as the most recent one, the sentences evicted to make
+    // room are returned from old to new.
+    std::vector<HistorySentence> add(HistorySentence sentence) {
+        std::vector<HistorySentence> popedSentence;
+        if (sentence.empty()) {
+            return popedSentence;
+        }
+        while (size_ >= maxSize_) {
+            popedSentence.push_back(remove(tail_));
+        }
+
+        uint32_t slot;
+        if (freeSlots_.empty()) {
+            slot = slots_.size();
+            slots_.emplace_back();
+        } else {
+            slot = freeSlots_.back();
+            freeSlots_.pop_back();
+        }
+        for (uint32_t i = 0; i < sentence.size(); i++) {
+            auto id = sentence[i].id_;
+            if (id >= index_.size()) {
+                index_.resize(id + 1);
+            }
+            sentence[i].posting_ = index_[id].size();
+            index_[id].push_back({slot, i});
+        }
+
+        auto &entry = slots_[slot];
+        entry.sentence_ = std::move(sentence);
+        entry.newer_ = npos;
+        entry.older_ = head_;
+        if (head_ != npos) {
+            slots_[head_].newer_ = slot;
+        } else {
+            tail_ = slot;
+        }
+        head_ = slot;
+        size_++;
+        return popedSentence;
+    }
+
+    size_t maxSize() const { return maxSize_; }
+
+    size_t realSize() const { return size_; }
+
+    // Remove all sentences that contain the word.
+    std::vector<HistorySentence> forget(uint32_t id) {
+        std::vector<HistorySentence> removed;
+        while (id < index_.size() && !index_[id].empty()) {
+            removed.push_back(remove(index_[id].back().slot_));
+        }
+        return removed;
+    }
+
+private:
+    struct Posting {
+        uint32_t slot_;
+        uint32_t pos_;
+    };
+
+    struct Slot {
+        HistorySentence sentence_;
+        uint32_t newer_ = npos;
+        uint32_t older_ = npos;
+    };
+
+    HistorySentence remove(uint32_t slot) {
+        auto &entry = slots_[slot];
+        for (const auto &word : entry.sentence_) {
+            auto &postings = index_[word.id_];
+            auto last = postings.back();
+            postings[word.posting_] = last;
+            slots_[last.slot_].sentence_[last.pos_].posting_ = word.posting_;
+            postings.pop_back();
+        }
+
+        if (entry.newer_ != npos) {
+            slots_[entry.newer_].older_ = entry.older_;
+        } else {
+            head_ = entry.older_;
+        }
+        if (entry.older_ != npos) {
+            slots_[entry.older_].newer_ = entry.newer_;
+        } else {
+            tail_ = entry.newer_;
+        }
+        freeSlots_.push_back(slot);
+        size_--;
+        return std::move(entry.sentence_);
+    }
+
+    const size_t maxSize_;
+
+    size_t size_ = 0;
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> freeSlots_;
+    uint32_t head_ = npos;
+    uint32_t tail_ = npos;
+    // Word id to the occurrences in sentences.
+    std::vector<std::vector<Posting>> index_;
+};
+
+class HistoryBigramPrivate {
+public:
+    HistoryBigramPrivate() {
+        for (auto size : historyPoolSize) {
+            pools_.emplace_back(size);
+        }
+        unigramSize_ = unigramSize();
+        smoothing_ = poolWeight_[0] / 2;
+    }
+
+    template <typename R>
+    void add(const R &sentence) {
+        // foreachNgramKey needs the first and last word.
+        if (sentence.empty()) {
+            return;
+        }
+        if (decayed_.enabled()) {
+            decayed_.add(sentence);
+            return;
+        }
+        HistorySentence newSentence;
+        for (const auto &word : sentence) {
+            newSentence.push_back({words_.ref(word), 0});
+        }
+        incSentence(0, newSentence);
+        populateSentence(pools_[0].add(std::move(newSentence)));
+    }
+
+    // Move sentences evicted from a pool to the next one. Counts are moved
+    // between pools in the shared tries, instead of removed and added again.
+    void populateSentence(std::vector<HistorySentence> popedSentence) {
+        size_t i = 1;
+        for (; !popedSentence.empty() && i < pools_.size(); i++) {
+            std::vector<HistorySentence> nextSentences;
+            for (auto &sentence : popedSentence) {
+                moveSentence(i - 1, i, sentence);
+                auto newPopedSentence = pools_[i].add(std::move(sentence));
+                std::move(newPopedSentence.begin(), newPopedSentence.end(),
+                          std::back_inserter(nextSentences));
+            }
+            popedSentence = std::move(nextSentences);
+        }
+        for (const auto &sentence : popedSentence) {
+            removeSentence(i - 1, sentence);
+        }
+    }
+
+    void loadPool(size_t pool, std::istream &in) {
+        uint32_t count = 0;
+        throw_if_io_fail(unmarshall(in, count));
+        while (count--) {
+            uint32_t size = 0;
+            throw_if_io_fail(unmarshall(in, size));
+            HistorySentence sentence;
+            while (size--) {
+                std::string buffer;
+                throw_if_io_fail(unmarshallString(in, buffer));
+                sentence.push_back({words_.ref(buffer), 0});
+            }
+            if (sentence.empty()) {
+                continue;
+            }
+            incSentence(pool, sentence);
+            for (const auto &poped : pools_[pool].add(std::move(sentence))) {
+                removeSentence(pool, poped);
+            }
+        }
+    }
+
+    // The snapshot holds the tries as they are, so loading it does not need to
+    // count every sentence again.
+    void loadSnapshot(std::istream &in) {
+        uint32_t poolSize = 0;
+        throw_if_io_fail(unmarshall(in, poolSize));
+        if (poolSize != pools_.size()) {
+            throw std::invalid_argument("Invalid history pool number.");
+        }
+        words_.load(in);
+        for (auto &pool : pools_) {
+            pool.loadIds(in, words_);
+        }
+        words_.finishLoad();
+        unigram_.load(in);
+        bigram_.load(in);
+        uint8_t hasTrigram = 0;
+        throw_if_io_fail(unmarshall(in, hasTrigram));
+        if (hasTrigram) {
+            trigram_.load(in);
+        }
+        if (!useTrigram_) {
+            trigram_.clear();
+        } else if (!hasTrigram) {
+            recountTrigram();
+        }
+    }
+
+    void saveSnapshot(std::ostream &out) {
+        throw_if_io_fail(marshall(out, static_cast<uint32_t>(pools_.size())));
+        words_.save(out);
+        for (const auto &pool : pools_) {
+            pool.saveIds(out);
+        }
+        unigram_.save(out);
+        bigram_.save(out);
+        throw_if_io_fail(marshall(out, static_cast<uint8_t>(useTrigram_)));
+        if (useTrigram_) {
+            trigram_.save(out);
+        }
+    }
+
+    void forget(std::string_view word) {
+        if (decayed_.enabled()) {
+            decayed_.forget(word);
+            return;
+        }
+        auto id = words_.find(word);
+        if (id == HistoryWordTable::npos) {
+            return;
+        }
+        for (size_t i = 0; i < pools_.size(); i++) {
+            for (const auto &sentence : pools_[i].forget(id)) {
+                removeSentence(i, sentence);
+            }
+        }
     }
 
-    void incFreq(std::string_view s, int32_t delta) {
-        trie_.update(s.data(), s.size(),
-                     [delta](int32_t v) { return v + delta; });
-        weightedSize_ += delta;
+    void clear() {
+        boost::range::for_each(pools_, std::mem_fn(&HistoryBigramPool::clear));
+        words_.clear();
+        unigram_.clear();
+        bigram_.clear();
+        trigram_.clear();
+        decayed_.clear();
     }
 
-    void decFreq(std::string_view s, int32_t delta) {
-        auto v = trie_.exactMatchSearch(s.data(), s.size());
-        if (trie_.isNoValue(v)) {
-            return;
+    void setDecayHalfLife(uint32_t halfLife) {
+        if (halfLife && !decayed_.enabled()) {
+            decayed_.setHalfLife(halfLife);
+            convertToDecayed();
+        } else {
+            decayed_.setHalfLife(halfLife);
         }
-        if (v <= delta) {
-            trie_.erase(s.data(), s.size());
-            decWeightedSize(v);
+        if (decayed_.enabled()) {
+            unigramSize_ = decayed_.size();
+            // Half of a new sentence, same as the pools.
+            smoothing_ = 0.5f;
         } else {
-            v -= delta;
-            trie_.set(s.data(), s.size(), v);
-            decWeightedSize(delta);
+            unigramSize_ = unigramSize();
+            smoothing_ = poolWeight_[0] / 2;
         }
     }
 
-    void eraseByKey(std::string_view s) {
-        auto v = trie_.exactMatchSearch(s.data(), s.size());
-        if (trie_.isNoValue(v)) {
-            return;
+    // Move the sentences in pools to the decayed history, from old to new.
+    void convertToDecayed() {
+        std::vector<std::string> words;
+        for (const auto &pool : boost::adaptors::reverse(pools_)) {
+            pool.foreach([this, &words](const HistorySentence &sentence) {
+                words.clear();
+                for (const auto &word : sentence) {
+                    words.push_back(words_.word(word.id_));
+                }
+                decayed_.add(words);
+            });
         }
-        trie_.erase(s);
-        decWeightedSize(v);
+        boost::range::for_each(pools_, std::mem_fn(&HistoryBigramPool::clear));
+        words_.clear();
+        unigram_.clear();
+        bigram_.clear();
+        trigram_.clear();
     }
 
-    void eraseByPrefix(std::string_view s) {
-        std::vector<std::pair<std::string, int32_t>> values;
-        trie_.foreach(s, [this, &values](TrieType::value_type value, size_t len,
-                                         TrieType::position_type pos) {
-            std::string buf;
-            trie().suffix(buf, len, pos);
-            values.emplace_back(std::move(buf), value);
-            return true;
-        });
-        for (auto &value : values) {
-            trie_.erase(value.first);
-            decWeightedSize(value.second);
-        }
+    float unigramFreq(std::string_view word) const {
+        return decayed_.enabled() ? decayed_.unigramFreq(word)
+                                  : unigram_.freq(word);
     }
 
-    void eraseBySuffix(std::string_view s) {
-        std::vector<std::pair<std::string, int32_t>> values;
-        trie_.foreach(s,
-                      [this, &values, s](TrieType::value_type value, size_t len,
-                                         TrieType::position_type pos) {
-                          std::string buf;
-                          trie().suffix(buf, len, pos);
-                          if (boost::ends_with(buf, s)) {
-                              values.emplace_back(std::move(buf), value);
-                          }
-                          return true;
-                      });
-        for (auto &value : values) {
-            trie_.erase(value.first);
-            decWeightedSize(value.second);
-        }
+    WeightedTrie::position_type bigramPrefix(std::string_view prev) const {
+        return decayed_.enabled() ? decayed_.bigramPrefix(prev)
+                                  : bigram_.prefix(prev);
     }
 
-    void fillPredict(std::unordered_set<std::string> &words,
-                     std::string_view word, size_t maxSize) const {
-        trie_.foreach(word,
-                      [this, &words, maxSize](TrieType::value_type, size_t len,
-                                              TrieType::position_type pos) {
-                          std::string buf;
-                          trie().suffix(buf, len, pos);
-                          // Skip special word.
-                          if (buf == "<s>" || buf == "</s>") {
-                              return true;
-                          }
-                          words.emplace(std::move(buf));
-
-                          if (maxSize > 0 && words.size() >= maxSize) {
-                              return false;
-                          }
-                          return true;
-                      });
+    float bigramFreq(WeightedTrie::position_type pos,
+                     std::string_view cur) const {
+        return decayed_.enabled() ? decayed_.bigramFreq(pos, cur)
+                                  : bigram_.freq(pos, cur);
     }
 
-private:
-    void decWeightedSize(int32_t v) {
-        weightedSize_ -= v;
-        if (weightedSize_ < 0) {
-            // This should not happen.
-            weightedSize_ = 0;
+    WeightedTrie::position_type trigramPrefix(std::string_view prev) const {
+        if (!useTrigram_) {
+            return 0;
         }
+        return decayed_.enabled() ? decayed_.trigramPrefix(prev)
+                                  : trigram_.prefix(prev);
     }
 
-    int32_t weightedSize_ = 0;
-    TrieType trie_;
-};
+    WeightedTrie::position_type trigramPrefix(WeightedTrie::position_type pos,
+                                              std::string_view prev) const {
+        return decayed_.enabled() ? decayed_.trigramPrefix(pos, prev)
+                                  : trigram_.prefix(pos, prev);
+    }
 
-class HistoryBigramPool {
-public:
-    HistoryBigramPool(size_t maxSize) : maxSize_(maxSize) {}
+    float trigramFreq(WeightedTrie::position_type pos,
+                      std::string_view cur) const {
+        return decayed_.enabled() ? decayed_.trigramFreq(pos, cur)
+                                  : trigram_.freq(pos, cur);
+    }
 
-    void load(std::istream &in) {
-        clear();
-        uint32_t count = 0;
-        throw_if_io_fail(unmarshall(in, count));
-        while (count--) {
-            uint32_t size = 0;
-            throw_if_io_fail(unmarshall(in, size));
-            std::vector<std::string> sentence;
-            while (size--) {
-                std::string buffer;
-                throw_if_io_fail(unmarshallString(in, buffer));
-                sentence.emplace_back(std::move(buffer));
-            }
-            add(sentence);
+    float unigramSize() const {
+        float size = 0;
+        for (size_t i = 0; i < pools_.size(); i++) {
+            size += pools_[i].maxSize() * poolWeight_[i];
         }
+        return size;
     }
 
-    void save(std::ostream &out) {
-        uint32_t count = recent_.size();
-        throw_if_io_fail(marshall(out, count));
-        // When we do save, we need to reverse the history order.
-        // Because loading the history is done by call "add", which basically
-        // expect the history from old to new.
-        for (auto &sentence : recent_ | boost::adaptors::reversed) {
-            uint32_t size = sentence.size();
-            throw_if_io_fail(marshall(out, size));
-            for (auto &s : sentence) {
-                throw_if_io_fail(marshallString(out, s));
+    // Call callback(trie, key) with every key counted for a sentence. The
+    // sentence boundaries are not counted again when a sentence is removed,
+    // so their unigram is only passed with boundaryUnigram.
+    template <typename Callback>
+    void foreachKey(const HistorySentence &sentence, bool boundaryUnigram,
+                    Callback callback) {
+        for (size_t i = 0; i < sentence.size(); i++) {
+            const auto &word = words_.word(sentence[i].id_);
+            callback(unigram_, word);
+            if (i + 1 < sentence.size()) {
+                callback(bigram_, ngramKey(key_, word,
+                                           words_.word(sentence[i + 1].id_)));
             }
         }
+        if (boundaryUnigram) {
+            callback(unigram_, "<s>");
+            callback(unigram_, "</s>");
+        }
+        callback(bigram_,
+                 ngramKey(key_, "<s>", words_.word(sentence.front().id_)));
+        callback(bigram_,
+                 ngramKey(key_, words_.word(sentence.back().id_), "</s>"));
+        if (useTrigram_) {
+            foreachTrigramKey(sentence, callback);
+        }
     }
 
-    void dump(std::ostream &out) const {
-        for (auto &sentence : recent_) {
-            bool first = true;
-            for (auto &s : sentence) {
-                if (first) {
-                    first = false;
-                } else {
-                    out << " ";
-                }
-                out << s;
-            }
-            out << std::endl;
+    // The first trigram of a sentence starts with "<s>".
+    template <typename Callback>
+    void foreachTrigramKey(const HistorySentence &sentence,
+                           Callback callback) {
+        for (size_t i = 0; i + 1 < sentence.size(); i++) {
+            std::string_view prev =
+                i ? std::string_view(words_.word(sentence[i - 1].id_))
+                  : std::string_view("<s>");
+            callback(trigram_,
+                     ngramKey(key_, prev, words_.word(sentence[i].id_),
+                              words_.word(sentence[i + 1].id_)));
         }
     }
 
-    void clear() {
-        recent_.clear();
-        unigram_.clear();
-        bigram_.clear();
-        size_ = 0;
+    void setUseTrigram(bool useTrigram) {
+        if (useTrigram_ == useTrigram) {
+            return;
+        }
+        useTrigram_ = useTrigram;
+        trigram_.clear();
+        decayed_.setUseTrigram(useTrigram);
+        if (useTrigram_) {
+            recountTrigram();
+        }
     }
 
-    template <typename R>
-    std::list<std::vector<std::string>> add(const R &sentence) {
-        std::list<std::vector<std::string>> popedSentence;
-        if (sentence.empty()) {
-            return popedSentence;
+    // Count the trigrams of the sentences in pools.
+    void recountTrigram() {
+        trigram_.clear();
+        for (size_t i = 0; i < pools_.size(); i++) {
+            pools_[i].foreach([this, i](const HistorySentence &sentence) {
+                foreachTrigramKey(
+                    sentence, [i](WeightedTrie &trie, std::string_view key) {
+                        trie.incFreq(i, key, 1);
+                    });
+            });
+        }
+    }
+
+    // Number of the newest sentences kept in pools, 0 if all are counted.
+    size_t sentenceCapacity() const {
+        if (decayed_.enabled()) {
+            return 0;
         }
-        while (recent_.size() >= maxSize_) {
-            remove(recent_.back());
-            popedSentence.splice(popedSentence.end(), recent_,
-                                 std::prev(recent_.end()));
+        size_t capacity = 0;
+        for (const auto &pool : pools_) {
+            capacity += pool.maxSize();
         }
+        return capacity;
+    }
 
-        std::vector<std::string> newSentence;
-        auto delta = 1;
-        for (auto iter = sentence.begin(), end = sentence.end(); iter != end;
-             iter++) {
-            unigram_.incFreq(*iter, delta);
-            auto next = std::next(iter);
-            if (next != end) {
-                incBigram(*iter, *next, delta);
+    // Same as clear followed by add of each sentence. Only the newest
+    // sentences that fit in pools are kept, and each of them is counted
+    // directly in the pool it ends up in. dropped is the number of sentences
+    // before them that are already left out.
+    void loadSentences(const std::vector<std::vector<std::string>> &sentences,
+                       size_t threads, size_t dropped) {
+        clear();
+        ImportSentences kept;
+        for (const auto &sentence : sentences) {
+            if (!sentence.empty()) {
+                kept.push_back(&sentence);
+            }
+        }
+        if (decayed_.enabled()) {
+            decayed_.loadSentences(std::move(kept), threads);
+            return;
+        }
+        const auto total = kept.size() + dropped;
+        const auto capacity = sentenceCapacity();
+        if (kept.size() > capacity) {
+            kept.erase(kept.begin(), kept.end() - capacity);
+        }
+        // The newest sentences are in the first pool.
+        auto poolOf = [this, &kept](size_t i) {
+            size_t age = kept.size() - 1 - i;
+            size_t pool = 0;
+            while (age >= pools_[pool].maxSize()) {
+                age -= pools_[pool].maxSize();
+                pool++;
+            }
+            return pool;
+        };
+
+        auto counts = countNgrams<PoolCount>(kept, useTrigram_, threads,
+                                             [&poolOf](size_t i) {
+                                                 PoolCount count = {};
+                                                 count[poolOf(i)] = 1;
+                                                 return count;
+                                             });
+        // The boundaries are counted in every pool a sentence passes, see
+        // moveSentence.
+        PoolCount boundary = {};
+        size_t passed = total;
+        for (size_t i = 0; i < pools_.size(); i++) {
+            boundary[i] = passed;
+            passed -= std::min(passed, pools_[i].maxSize());
+        }
+        counts[0]["<s>"] = counts[0]["</s>"] = boundary;
+
+        const std::array<WeightedTrie *, 3> tries = {&unigram_, &bigram_,
+                                                     &trigram_};
+        for (size_t order = 0; order < counts.size(); order++) {
+            for (const auto &item : counts[order]) {
+                for (size_t i = 0; i < item.second.size(); i++) {
+                    if (item.second[i]) {
+                        tries[order]->incFreq(i, item.first, item.second[i]);
+                    }
+                }
+            }
+        }
+        for (size_t i = 0; i < kept.size(); i++) {
+            HistorySentence sentence;
+            for (const auto &word : *kept[i]) {
+                sentence.push_back({words_.ref(word), 0});
             }
-            std::string ss;
-            ss += *iter;
-            newSentence.push_back(ss);
+            pools_[poolOf(i)].add(std::move(sentence));
         }
-        recent_.push_front(std::move(newSentence));
-        unigram_.incFreq("<s>", delta);
-        unigram_.incFreq("</s>", delta);
-        incBigram("<s>", sentence.front(), delta);
-        incBigram(sentence.back(), "</s>", delta);
+    }
 
-        return popedSentence;
+    void incSentence(size_t pool, const HistorySentence &sentence) {
+        foreachKey(sentence, true,
+                   [pool](WeightedTrie &trie, std::string_view key) {
+                       trie.incFreq(pool, key, 1);
+                   });
     }
 
-    float unigramFreq(std::string_view s) const {
-        auto v = unigram_.freq(s);
-        return v;
+    void moveSentence(size_t from, size_t to, const HistorySentence &sentence) {
+        foreachKey(sentence, false,
+                   [from, to](WeightedTrie &trie, std::string_view key) {
+                       trie.moveFreq(from, to, key, 1);
+                   });
+        unigram_.incFreq(to, "<s>", 1);
+        unigram_.incFreq(to, "</s>", 1);
     }
 
-    float bigramFreq(std::string_view s1, std::string_view s2) const {
-        std::string s;
-        s.append(s1.data(), s1.size());
-        s += '|';
-        s.append(s2.data(), s2.size());
-        auto v = bigram_.freq(s);
-        return v;
+    // Remove the counts of a sentence that leaves the history.
+    void removeSentence(size_t pool, const HistorySentence &sentence) {
+        foreachKey(sentence, false,
+                   [pool](WeightedTrie &trie, std::string_view key) {
+                       trie.decFreq(pool, key, 1);
+                   });
+        for (const auto &word : sentence) {
+            words_.unref(word.id_);
+        }
     }
 
-    bool isUnknown(std::string_view word) const {
-        return unigramFreq(word) == 0;
+    // Per word data looked up on every lattice edge: the unigram frequency
+    // and the position of "word|" in the bigram and trigram trie.
+    struct WordContext {
+        uint64_t pos_ = 0;
+        uint64_t trigramPrefix_ = 0;
+        float freq_ = 0;
+        uint32_t generation_ = 0;
+    };
+
+    // The cache is direct mapped and dropped by bumping the generation
+    // whenever the pools change. Each thread has its own cache, so readers
+    // only share the history under the shared lock. Since generations are
+    // unique, it is shared by all instances.
+    struct WordCacheEntry {
+        std::string word_;
+        WordContext context_;
+    };
+
+    const WordContext &cachedContext(std::string_view word) const {
+        thread_local std::vector<WordCacheEntry> wordCache(1024);
+        auto &entry = wordCache[std::hash<std::string_view>()(word) &
+                                (wordCache.size() - 1)];
+        if (entry.context_.generation_ != generation_ || entry.word_ != word) {
+            entry.word_ = word;
+            entry.context_.pos_ = bigramPrefix(word);
+            entry.context_.trigramPrefix_ = trigramPrefix(word);
+            entry.context_.freq_ = unigramFreq(word);
+            entry.context_.generation_ = generation_;
+        }
+        return entry.context_;
     }
 
-    size_t maxSize() const { return maxSize_; }
+    // Generations are unique across all instances, so a context from another
+    // history is never taken as valid.
+    static uint32_t newGeneration() {
+        static std::atomic<uint32_t> generation{0};
+        return ++generation;
+    }
 
-    size_t realSize() const { return recent_.size(); }
+    void invalidateCache() { generation_ = newGeneration(); }
 
-    void forget(std::string_view word) {
-        auto iter = recent_.begin();
-        while (iter != recent_.end()) {
-            if (std::find(iter->begin(), iter->end(), word) != iter->end()) {
-                remove(*iter);
-                iter = recent_.erase(iter);
-            } else {
-                ++iter;
-            }
+    // Copied, since the entry may be replaced by the next lookup.
+    WordContext wordContext(std::string_view word) const {
+        if (word.empty()) {
+            word = "<s>";
         }
+        return cachedContext(word);
     }
 
-    void fillPredict(std::unordered_set<std::string> &words,
-                     std::string_view word, size_t maxSize = 0) const {
-        bigram_.fillPredict(words, word, maxSize);
+    // Without the word before prev, there is no trigram.
+    HistoryBigramContext context(std::string_view /*prev*/) const {
+        HistoryBigramContext context;
+        context.generation_ = generation_;
+        return context;
     }
 
-private:
-    template <typename R>
-    void remove(const R &sentence) {
-        const int delta = 1;
-        for (auto iter = sentence.begin(), end = sentence.end(); iter != end;
-             iter++) {
-            unigram_.decFreq(*iter, delta);
-            auto next = std::next(iter);
-            if (next != end) {
-                decBigram(*iter, *next, delta);
-            }
+    // The trigram part only depends on prev and cur, so context is not used.
+    HistoryBigramContext nextContext(const HistoryBigramContext & /*context*/,
+                                     std::string_view prev,
+                                     std::string_view cur) const {
+        auto next = context(cur);
+        auto prevContext = wordContext(prev);
+        if (!prevContext.trigramPrefix_) {
+            return next;
         }
-        decBigram("<s>", sentence.front(), delta);
-        decBigram(sentence.back(), "</s>", delta);
+        next.pairFreq_ = bigramFreq(prevContext.pos_, cur);
+        if (next.pairFreq_ > 0) {
+            next.trigramPos_ = trigramPrefix(prevContext.trigramPrefix_, cur);
+        }
+        return next;
     }
 
-    void decBigram(std::string_view s1, std::string_view s2, int32_t delta) {
-        std::string ss;
-        ss.append(s1.data(), s1.size());
-        ss += '|';
-        ss.append(s2.data(), s2.size());
-        bigram_.decFreq(ss, delta);
+    float score(const HistoryBigramContext &context, std::string_view prev,
+                std::string_view cur) const {
+        if (cur.empty()) {
+            cur = "<unk>";
+        }
+
+        auto prevContext = wordContext(prev);
+        auto uf0 = prevContext.freq_;
+        auto bf = bigramFreq(prevContext.pos_, cur);
+        auto uf1 = cachedContext(cur).freq_;
+
+        float bigramWeight = useOnlyUnigram_ ? 0.0f : 0.68f;
+        float pr = 0.0f;
+        pr += bigramWeight * float(bf) / float(uf0 + smoothing_);
+        pr += (1.0f - bigramWeight) * float(uf1) /
+              float(unigramSize_ + smoothing_);
+
+        // Interpolate with the trigram once the last two words are seen
+        // together.
+        if (context.generation_ == generation_ && context.pairFreq_ > 0 &&
+            !useOnlyUnigram_) {
+            auto tf = trigramFreq(context.trigramPos_, cur);
+            const float trigramWeight = 0.5f;
+            pr = trigramWeight * float(tf) /
+                     float(context.pairFreq_ + smoothing_) +
+                 (1.0f - trigramWeight) * pr;
+        }
+
+        if (pr >= 1.0) {
+            pr = 1.0;
+        }
+        if (pr == 0) {
+            return unknown_;
+        }
+
+        return std::log10(pr);
     }
 
-    void incBigram(std::string_view s1, std::string_view s2, int delta) {
-        std::string ss;
-        ss.append(s1.data(), s1.size());
-        ss += '|';
-        ss.append(s2.data(), s2.size());
-        bigram_.incFreq(ss, delta);
+    // Load into an empty history, see replace.
+    void load(std::istream &in, uint32_t version) {
+        // Pools are converted if the decayed history is used.
+        const auto halfLife = decayed_.halfLife();
+        setDecayHalfLife(0);
+        switch (version) {
+        case 1:
+            for (size_t i = 0; i < 2; i++) {
+                loadPool(i, in);
+            }
+            break;
+        case historyReplayFormatVersion:
+            for (size_t i = 0; i < pools_.size(); i++) {
+                loadPool(i, in);
+            }
+            break;
+        case historyBinaryFormatVersion:
+            loadSnapshot(in);
+            break;
+        case historyDecayedFormatVersion:
+            decayed_.load(in);
+            // Use the half life of the file.
+            setDecayHalfLife(decayed_.halfLife());
+            return;
+        default: {
+            throw std::invalid_argument("Invalid history version.");
+        }
+        }
+        setDecayHalfLife(halfLife);
     }
 
-    const size_t maxSize_;
+    // Build a new history with the same settings by calling fill on it, and
+    // replace the current one. fill runs without the lock, so readers are
+    // only blocked by the replacement, and an exception from it keeps the
+    // current history.
+    template <typename Fill>
+    void replace(Fill fill) {
+        HistoryBigramPrivate other;
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            other.setUseTrigram(useTrigram_);
+            other.setDecayHalfLife(decayed_.halfLife());
+        }
+        fill(other);
 
-    // Used when maxSize_ != 0.
-    size_t size_ = 0;
-    std::list<std::vector<std::string>> recent_;
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        invalidateCache();
+        swapHistory(other);
+        resetLog();
+    }
 
-    // Used for look up
-    WeightedTrie unigram_;
-    WeightedTrie bigram_;
-};
+    // Swap the counted history, the settings are kept.
+    void swapHistory(HistoryBigramPrivate &other) {
+        unigram_.swap(other.unigram_);
+        bigram_.swap(other.bigram_);
+        trigram_.swap(other.trigram_);
+        std::swap(words_, other.words_);
+        std::swap(pools_, other.pools_);
+        std::swap(decayed_, other.decayed_);
+        std::swap(unigramSize_, other.unigramSize_);
+        std::swap(smoothing_, other.smoothing_);
+    }
 
-// We define the frequency as following.
-// (1 - p) the frequency belongs to first pool.
-// p * (1 - p) Second pool
-// p^2 * (1 - p) Third pool
-// ...
-// p^(n-1) n-th pool.
-// In sum, it's (1-p) * p^(i - 1)
-// And then we define alpha as p = 1 / (1 + alpha).
-class HistoryBigramPrivate {
-public:
-    HistoryBigramPrivate() {}
-
-    void populateSentence(std::list<std::vector<std::string>> popedSentence) {
-        for (size_t i = 1; !popedSentence.empty() && i < pools_.size(); i++) {
-            std::list<std::vector<std::string>> nextSentences;
-            while (!popedSentence.empty()) {
-                auto newPopedSentence = pools_[i].add(popedSentence.front());
-                popedSentence.pop_front();
-                nextSentences.splice(nextSentences.end(), newPopedSentence);
-            }
-            popedSentence = std::move(nextSentences);
+    // Record a change for saveLog. Once there are too many, they are dropped
+    // and only save can keep the history.
+    void appendLog(HistoryLogType type, std::vector<std::string> words) {
+        if (logOverflow_) {
+            return;
+        }
+        if (log_.size() >= historyLogMaxSize) {
+            std::vector<HistoryLogRecord>().swap(log_);
+            logOverflow_ = true;
+            return;
         }
+        log_.push_back({type, std::move(words)});
     }
 
-    float unigramFreq(std::string_view word) const {
-        assert(pools_.size() == poolWeight_.size());
-        float freq = 0;
-        for (size_t i = 0; i < pools_.size(); i++) {
-            freq += pools_[i].unigramFreq(word) * poolWeight_[i];
-        }
-        return freq;
+    void resetLog() {
+        log_.clear();
+        logOverflow_ = false;
+        logSize_ = 0;
     }
 
-    float bigramFreq(std::string_view prev, std::string_view cur) const {
-        assert(pools_.size() == poolWeight_.size());
-        float freq = 0;
-        for (size_t i = 0; i < pools_.size(); i++) {
-            freq += pools_[i].bigramFreq(prev, cur) * poolWeight_[i];
+    void saveLog(std::ostream &out) const {
+        throw_if_io_fail(marshall(out, historyLogFormatMagic));
+        throw_if_io_fail(marshall(out, historyLogFormatVersion));
+        throw_if_io_fail(marshall(out, static_cast<uint32_t>(log_.size())));
+        for (const auto &record : log_) {
+            throw_if_io_fail(marshall(out, static_cast<uint8_t>(record.type_)));
+            throw_if_io_fail(
+                marshall(out, static_cast<uint32_t>(record.words_.size())));
+            for (const auto &word : record.words_) {
+                throw_if_io_fail(marshallString(out, word));
+            }
         }
-        return freq;
     }
 
-    float unigramSize() const {
-        float size = 0;
-        for (size_t i = 0; i < pools_.size(); i++) {
-            size += pools_[i].maxSize() * poolWeight_[i];
+    // Read a block written by saveLog. Return false if the block is cut
+    // short, which is the case if writing it was interrupted.
+    static bool loadLog(std::istream &in,
+                        std::vector<HistoryLogRecord> &records) {
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint32_t count = 0;
+        if (!unmarshall(in, magic)) {
+            return false;
         }
-        return size;
+        if (magic != historyLogFormatMagic) {
+            throw std::invalid_argument("Invalid history log magic.");
+        }
+        if (!unmarshall(in, version)) {
+            return false;
+        }
+        if (version != historyLogFormatVersion) {
+            throw std::invalid_argument("Invalid history log version.");
+        }
+        if (!unmarshall(in, count)) {
+            return false;
+        }
+        while (count--) {
+            uint8_t type = 0;
+            uint32_t size = 0;
+            if (!unmarshall(in, type) || !unmarshall(in, size)) {
+                return false;
+            }
+            if (type > static_cast<uint8_t>(HistoryLogType::Clear)) {
+                throw std::invalid_argument("Invalid history log record.");
+            }
+            auto &record = records.emplace_back();
+            record.type_ = static_cast<HistoryLogType>(type);
+            while (size--) {
+                if (!unmarshallString(in, record.words_.emplace_back())) {
+                    return false;
+                }
+            }
+        }
+        return true;
     }
 
     // A log probabilty.
     float unknown_ =
         std::log10(DEFAULT_LANGUAGE_MODEL_UNKNOWN_PROBABILITY_PENALTY);
     bool useOnlyUnigram_ = false;
+    const PoolWeight poolWeight_ = historyPoolWeight();
+    WeightedTrie unigram_{poolWeight_};
+    WeightedTrie bigram_{poolWeight_};
+    WeightedTrie trigram_{poolWeight_};
+    bool useTrigram_ = false;
+    HistoryWordTable words_;
     std::vector<HistoryBigramPool> pools_;
-    std::vector<float> poolWeight_;
+    // Reused buffer for n-gram key.
+    std::string key_;
+    DecayedHistory decayed_;
+    float unigramSize_ = 0;
+    // Added to the denominator to avoid div 0.
+    float smoothing_ = 0;
+    uint32_t generation_ = newGeneration();
+    // Changes since the last save or saveLog.
+    std::vector<HistoryLogRecord> log_;
+    // Changes were dropped from log_, so it can't be saved.
+    bool logOverflow_ = false;
+    // Number of records in log since the last save.
+    size_t logSize_ = 0;
+    // Shared by readers, held exclusively by any change to history or its
+    // settings.
+    mutable std::shared_mutex mutex_;
 };
 
 HistoryBigram::HistoryBigram()
     : d_ptr(std::make_unique<HistoryBigramPrivate>()) {
-    FCITX_D();
-    const float p = 1.0 / (1 + HISTORY_BIGRAM_ALPHA_VALUE);
-    constexpr std::array<int, 3> poolSize = {128, 8192, 65536};
-    for (auto size : poolSize) {
-        d->pools_.emplace_back(size);
-        float portion = 1.0f;
-        if (d->pools_.size() != poolSize.size()) {
-            portion *= 1 - p;
-        }
-        portion *= std::pow(p, d->pools_.size() - 1);
-        d->poolWeight_.push_back(portion / d->pools_.back().maxSize());
-    }
     setUnknownPenalty(
         std::log10(DEFAULT_LANGUAGE_MODEL_UNKNOWN_PROBABILITY_PENALTY));
 }
@@ -390,72 +1683,125 @@ FCITX_DEFINE_DEFAULT_DTOR_AND_MOVE(HistoryBigram)
 
 void HistoryBigram::setUnknownPenalty(float unknown) {
     FCITX_D();
+    std::unique_lock<std::shared_mutex> lock(d->mutex_);
     d->unknown_ = unknown;
 }
 
 float HistoryBigram::unknownPenalty() const {
     FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
     return d->unknown_;
 }
 
 void HistoryBigram::setUseOnlyUnigram(bool useOnlyUnigram) {
     FCITX_D();
+    std::unique_lock<std::shared_mutex> lock(d->mutex_);
     d->useOnlyUnigram_ = useOnlyUnigram;
 }
 
 bool HistoryBigram::useOnlyUnigram() const {
     FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
     return d->useOnlyUnigram_;
 }
 
-void HistoryBigram::add(const libime::SentenceResult &sentence) {
+void HistoryBigram::setDecayHalfLife(uint32_t halfLife) {
     FCITX_D();
-    d->populateSentence(
-        d->pools_[0].add(sentence.sentence() |
-                         boost::adaptors::transformed(
-                             [](const auto &item) { return item->word(); })));
+    std::unique_lock<std::shared_mutex> lock(d->mutex_);
+    if (halfLife == d->decayed_.halfLife()) {
+        return;
+    }
+    d->invalidateCache();
+    d->setDecayHalfLife(halfLife);
 }
 
-void HistoryBigram::add(const std::vector<std::string> &sentence) {
+uint32_t HistoryBigram::decayHalfLife() const {
     FCITX_D();
-    d->populateSentence(d->pools_[0].add(sentence));
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    return d->decayed_.halfLife();
 }
 
-bool HistoryBigram::isUnknown(std::string_view v) const {
+size_t HistoryBigram::sentenceCapacity() const {
     FCITX_D();
-    return boost::algorithm::all_of(
-        d->pools_,
-        [v](const HistoryBigramPool &pool) { return pool.isUnknown(v); });
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    return d->sentenceCapacity();
 }
 
-float HistoryBigram::score(std::string_view prev, std::string_view cur) const {
+void HistoryBigram::setUseTrigram(bool useTrigram) {
     FCITX_D();
-    if (prev.empty()) {
-        prev = "<s>";
-    }
-    if (cur.empty()) {
-        cur = "<unk>";
+    std::unique_lock<std::shared_mutex> lock(d->mutex_);
+    if (useTrigram == d->useTrigram_) {
+        return;
     }
+    d->invalidateCache();
+    d->setUseTrigram(useTrigram);
+}
 
-    auto uf0 = d->unigramFreq(prev);
-    auto bf = d->bigramFreq(prev, cur);
-    auto uf1 = d->unigramFreq(cur);
-
-    float bigramWeight = d->useOnlyUnigram_ ? 0.0f : 0.68f;
-    // add 0.5 to avoid div 0
-    float pr = 0.0f;
-    pr += bigramWeight * float(bf) / float(uf0 + d->poolWeight_[0] / 2);
-    pr += (1.0f - bigramWeight) * float(uf1) /
-          float(d->unigramSize() + d->poolWeight_[0] / 2);
+bool HistoryBigram::useTrigram() const {
+    FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    return d->useTrigram_;
+}
 
-    if (pr >= 1.0) {
-        pr = 1.0;
+void HistoryBigram::add(const libime::SentenceResult &sentence) {
+    std::vector<std::string> words;
+    for (const auto *item : sentence.sentence()) {
+        words.push_back(item->word());
     }
-    if (pr == 0) {
-        return d->unknown_;
+    add(words);
+}
+
+void HistoryBigram::add(const std::vector<std::string> &sentence) {
+    FCITX_D();
+    if (sentence.empty()) {
+        return;
     }
+    std::unique_lock<std::shared_mutex> lock(d->mutex_);
+    d->invalidateCache();
+    d->appendLog(HistoryLogType::Add, sentence);
+    d->add(sentence);
+}
+
+bool HistoryBigram::isUnknown(std::string_view v) const {
+    FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    return d->unigramFreq(v) == 0;
+}
+
+HistoryBigramContext HistoryBigram::context(std::string_view prev) const {
+    FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    return d->context(prev);
+}
+
+HistoryBigramContext
+HistoryBigram::nextContext(const HistoryBigramContext &context,
+                           std::string_view prev, std::string_view cur) const {
+    FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    return d->nextContext(context, prev, cur);
+}
+
+float HistoryBigram::score(std::string_view prev, std::string_view cur) const {
+    FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    return d->score(d->context(prev), prev, cur);
+}
 
-    return std::log10(pr);
+float HistoryBigram::score(const HistoryBigramContext &context,
+                           std::string_view prev, std::string_view cur) const {
+    FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    return d->score(context, prev, cur);
+}
+
+float HistoryBigram::score(const HistoryBigramContext &context,
+                           std::string_view prev, std::string_view cur,
+                           HistoryBigramContext &next) const {
+    FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    next = d->nextContext(context, prev, cur);
+    return d->score(context, prev, cur);
 }
 
 void HistoryBigram::load(std::istream &in) {
@@ -467,42 +1813,115 @@ void HistoryBigram::load(std::istream &in) {
         throw std::invalid_argument("Invalid history magic.");
     }
     throw_if_io_fail(unmarshall(in, version));
-    switch (version) {
-    case 1:
-        std::for_each_n(d->pools_.begin(), 2,
-                        [&in](auto &pool) { pool.load(in); });
-        break;
-    case historyBinaryFormatVersion:
-        boost::range::for_each(d->pools_, [&in](auto &pool) { pool.load(in); });
-        break;
-    default: {
-        throw std::invalid_argument("Invalid history version.");
-    }
-    }
+    d->replace([&in, version](HistoryBigramPrivate &other) {
+        other.load(in, version);
+    });
+}
+
+void HistoryBigram::loadSentences(
+    const std::vector<std::vector<std::string>> &sentences, size_t threads,
+    size_t dropped) {
+    FCITX_D();
+    d->replace([&sentences, threads, dropped](HistoryBigramPrivate &other) {
+        other.loadSentences(sentences, threads, dropped);
+    });
 }
 
 void HistoryBigram::save(std::ostream &out) {
     FCITX_D();
+    std::unique_lock<std::shared_mutex> lock(d->mutex_);
     throw_if_io_fail(marshall(out, historyBinaryFormatMagic));
-    throw_if_io_fail(marshall(out, historyBinaryFormatVersion));
-    boost::range::for_each(d->pools_, [&out](auto &pool) { pool.save(out); });
+    if (d->decayed_.enabled()) {
+        throw_if_io_fail(marshall(out, historyDecayedFormatVersion));
+        d->decayed_.save(out);
+    } else {
+        throw_if_io_fail(marshall(out, historyBinaryFormatVersion));
+        d->saveSnapshot(out);
+    }
+    d->resetLog();
+}
+
+bool HistoryBigram::saveLog(std::ostream &out) {
+    FCITX_D();
+    std::unique_lock<std::shared_mutex> lock(d->mutex_);
+    if (d->logOverflow_) {
+        return false;
+    }
+    if (d->log_.empty()) {
+        return true;
+    }
+    d->saveLog(out);
+    d->logSize_ += d->log_.size();
+    d->log_.clear();
+    return true;
+}
+
+void HistoryBigram::loadLog(std::istream &in) {
+    FCITX_D();
+    std::vector<HistoryLogRecord> records;
+    while (in.peek() != std::istream::traits_type::eof()) {
+        records.clear();
+        if (!HistoryBigramPrivate::loadLog(in, records)) {
+            break;
+        }
+        std::unique_lock<std::shared_mutex> lock(d->mutex_);
+        d->invalidateCache();
+        for (const auto &record : records) {
+            switch (record.type_) {
+            case HistoryLogType::Add:
+                // Only from a damaged log, since add ignores empty sentences.
+                if (!record.words_.empty()) {
+                    d->add(record.words_);
+                }
+                break;
+            case HistoryLogType::Forget:
+                for (const auto &word : record.words_) {
+                    d->forget(word);
+                }
+                break;
+            case HistoryLogType::Clear:
+                d->clear();
+                break;
+            }
+        }
+        d->logSize_ += records.size();
+    }
+}
+
+size_t HistoryBigram::logSize() const {
+    FCITX_D();
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    return d->logSize_;
 }
 
 void HistoryBigram::dump(std::ostream &out) {
     FCITX_D();
-    boost::range::for_each(d->pools_,
-                           [&out](const auto &pool) { pool.dump(out); });
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    if (d->decayed_.enabled()) {
+        d->decayed_.dump(out);
+        return;
+    }
+    boost::range::for_each(
+        d->pools_, [d, &out](const auto &pool) { pool.dump(out, d->words_); });
 }
 
 void HistoryBigram::clear() {
     FCITX_D();
-    boost::range::for_each(d->pools_, std::mem_fn(&HistoryBigramPool::clear));
+    std::unique_lock<std::shared_mutex> lock(d->mutex_);
+    d->invalidateCache();
+    d->clear();
+    // Replaying clear doesn't depend on earlier changes.
+    d->log_.clear();
+    d->logOverflow_ = false;
+    d->appendLog(HistoryLogType::Clear, {});
 }
 
 void HistoryBigram::forget(std::string_view word) {
     FCITX_D();
-    boost::range::for_each(d->pools_,
-                           [word](auto &pool) { pool.forget(word); });
+    std::unique_lock<std::shared_mutex> lock(d->mutex_);
+    d->invalidateCache();
+    d->appendLog(HistoryLogType::Forget, {std::string(word)});
+    d->forget(word);
 }
 
 void HistoryBigram::fillPredict(std::unordered_set<std::string> &words,
@@ -519,9 +1938,24 @@ void HistoryBigram::fillPredict(std::unordered_set<std::string> &words,
         lookup = "<s>";
     }
     lookup += "|";
-    boost::range::for_each(
-        d->pools_, [&words, lookup, maxSize](const HistoryBigramPool &pool) {
-            pool.fillPredict(words, lookup, maxSize);
-        });
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    if (d->decayed_.enabled()) {
+        d->decayed_.bigram().fillPredict(words, lookup, maxSize);
+    } else {
+        d->bigram_.fillPredict(words, lookup, maxSize);
+    }
+}
+
+void HistoryBigram::foreachPredict(
+    std::string_view prev,
+    const std::function<bool(std::string_view)> &callback) const {
+    FCITX_D();
+    std::string buf;
+    std::shared_lock<std::shared_mutex> lock(d->mutex_);
+    if (d->decayed_.enabled()) {
+        d->decayed_.bigram().foreachPredict(prev, buf, callback);
+    } else {
+        d->bigram_.foreachPredict(prev, buf, callback);
+    }
 }
 } // namespace libime
@@ -8,6 +8,8 @@
 
 #include "libimecore_export.h"
 #include <fcitx-utils/macros.h>
+#include <cstdint>
+#include <functional>
 #include <libime/core/lattice.h>
 #include <memory>
 #include <string>
@@ -19,15 +21,76 @@ namespace libime {
 class HistoryBigramPrivate;
 class HistoryBigram;
 
+/// \brief Cached lookup of the previous two words in history.
+///
+/// It holds the trie position of "prev2|prev|" if trigram is used, so words
+/// after the same two words can be scored without walking them again. The
+/// lookup of prev alone is cached per word by HistoryBigram, which keeps the
+/// context small enough to be stored in State. It is only valid until the
+/// history is modified, after which it is ignored by HistoryBigram.
+struct HistoryBigramContext {
+    uint64_t trigramPos_ = 0;
+    float pairFreq_ = 0;
+    uint32_t generation_ = 0;
+};
+
+/// \brief User history of sentences, used to adjust the language model.
+///
+/// All const functions may be called from many threads at once, along with
+/// one thread making changes, e.g. add. Readers share a lock, which any change
+/// holds exclusively for its duration. Moving the object itself is not
+/// synchronized.
 class LIBIMECORE_EXPORT HistoryBigram {
 public:
     HistoryBigram();
 
     FCITX_DECLARE_VIRTUAL_DTOR_MOVE(HistoryBigram);
 
+    /// \brief Load history saved by save.
+    ///
+    /// The file is read into a new history, which replaces the current one
+    /// when it is complete. So readers are only blocked for the replacement,
+    /// and the current history is kept if the file is invalid.
     void load(std::istream &in);
     void save(std::ostream &out);
+
+    /// \brief Replace history with sentences, ordered from old to new.
+    ///
+    /// The result is the same as clear followed by add of each sentence, up
+    /// to rounding of decayed counts, but n-grams are counted in one pass
+    /// instead of moving each sentence through the pools. The counting is
+    /// split between threads, 0 uses one per core. Like load, the log starts
+    /// over, so save should be called to keep the result.
+    ///
+    /// Sentences older than sentenceCapacity may be left out by the caller,
+    /// with their number passed as dropped, since they are still counted as
+    /// sentence boundaries.
+    void loadSentences(const std::vector<std::vector<std::string>> &sentences,
+                       size_t threads = 0, size_t dropped = 0);
     void dump(std::ostream &out);
+
+    /// \brief Append the changes since the last save or saveLog to a log.
+    ///
+    /// Each call only writes the sentences added since then, so it is cheap to
+    /// call after every change. A file may hold the output of many calls, and
+    /// is replayed with loadLog on top of the history saved by save.
+    ///
+    /// Only a limited number of changes are kept between calls. If there are
+    /// more, nothing is written and false is returned, and save needs to be
+    /// called instead to keep the history.
+    bool saveLog(std::ostream &out);
+
+    /// \brief Replay a log written by saveLog.
+    ///
+    /// Reading stops at a block that is cut short, e.g. by an interrupted
+    /// write, and the blocks before it are kept.
+    void loadLog(std::istream &in);
+
+    /// \brief Number of records in the log since the last save or load.
+    ///
+    /// Once it grows large, the log can be compacted by calling save and
+    /// truncating the log.
+    size_t logSize() const;
     void clear();
 
     /// Set unknown probability penatly.
@@ -38,6 +101,35 @@ public:
     void setUseOnlyUnigram(bool useOnlyUnigram);
     bool useOnlyUnigram() const;
 
+    /// \brief Use time decayed counts instead of pools of recent sentences.
+    ///
+    /// Each n-gram keeps a single count, which is halved every halfLife
+    /// sentences. Sentences are not kept, so larger history fits in the same
+    /// memory, and dump prints the count of each word instead. History in
+    /// pools is converted when it is enabled, 0 switches back to pools and
+    /// drops the decayed counts.
+    ///
+    /// Loading a saved history converts it to the current mode, except one
+    /// saved with decayed counts, which keeps its own half life.
+    void setDecayHalfLife(uint32_t halfLife);
+    uint32_t decayHalfLife() const;
+
+    /// \brief Number of the newest sentences kept in pools.
+    ///
+    /// Only the number of older sentences makes a difference to history, see
+    /// loadSentences. It is 0 with decayed counts, where every sentence is
+    /// counted.
+    size_t sentenceCapacity() const;
+
+    /// \brief Also count trigrams of history.
+    ///
+    /// The trigram is interpolated in score when the last two words are
+    /// seen together in history, which needs the context from nextContext.
+    /// When it is enabled, trigrams of the sentences in pools are counted,
+    /// while decayed history only counts trigrams from now on.
+    void setUseTrigram(bool useTrigram);
+    bool useTrigram() const;
+
     void forget(std::string_view word);
 
     bool isUnknown(std::string_view v) const;
@@ -45,6 +137,25 @@ public:
         return score(prev ? prev->word() : "", cur ? cur->word() : "");
     }
     float score(std::string_view prev, std::string_view cur) const;
+
+    /// Return the context to score words after prev.
+    HistoryBigramContext context(std::string_view prev) const;
+    /// \brief Return the context to score words after cur.
+    ///
+    /// context is the one used to score cur after prev, so the trigram of
+    /// prev and cur can be used.
+    HistoryBigramContext nextContext(const HistoryBigramContext &context,
+                                     std::string_view prev,
+                                     std::string_view cur) const;
+    /// Same as score(prev, cur), context is the result of context(prev).
+    float score(const HistoryBigramContext &context, std::string_view prev,
+                std::string_view cur) const;
+    /// \brief Same as score(context, prev, cur), and set next to the result of
+    /// nextContext(context, prev, cur).
+    ///
+    /// Both are computed under one lock, so they always see the same history.
+    float score(const HistoryBigramContext &context, std::string_view prev,
+                std::string_view cur, HistoryBigramContext &next) const;
     void add(const SentenceResult &sentence);
     void add(const std::vector<std::string> &sentence);
 
@@ -53,6 +164,15 @@ public:
                      const std::vector<std::string> &sentence,
                      size_t maxSize) const;
 
+    /// \brief Call callback with each word that follows prev in history.
+    ///
+    /// The same word may be passed more than once. The view is only valid
+    /// during the call, return false from callback to stop. The history is
+    /// locked during the call, so callback must not use it.
+    void foreachPredict(
+        std::string_view prev,
+        const std::function<bool(std::string_view)> &callback) const;
+
 private:
     std::unique_ptr<HistoryBigramPrivate> d_ptr;
     FCITX_DECLARE_PRIVATE(HistoryBigram);
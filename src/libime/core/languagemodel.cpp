@@ -9,6 +9,7 @@
 #include "constants.h"
 #include "lattice.h"
 #include "lm/model.hh"
+#include "prediction.h"
 #include <fcitx-utils/fs.h>
 #include <fstream>
 #include <type_traits>
@@ -19,11 +20,81 @@ class StaticLanguageModelFilePrivate {
 public:
     StaticLanguageModelFilePrivate(const char *file,
                                    const lm::ngram::Config &config)
-        : model_(file, config), file_(file) {}
-    lm::ngram::QuantArrayTrieModel model_;
+        : model_(lm::ngram::LoadVirtual(file, config)),
+          trieModel_(dynamic_cast<const lm::ngram::QuantArrayTrieModel *>(
+              model_.get())),
+          file_(file) {
+        if (model_->StateSize() != sizeof(lm::ngram::State)) {
+            throw std::invalid_argument("Unsupported language model.");
+        }
+    }
+    // The data structure is detected from the binary file, so the file may be
+    // either a (quantized) trie for less memory, or a probing hash table for
+    // faster lookup.
+    std::unique_ptr<lm::base::Model> model_;
+    // Set if model_ is the default quantized trie, so it can be scored
+    // without a virtual call.
+    const lm::ngram::QuantArrayTrieModel *trieModel_;
     std::string file_;
     mutable bool predictionLoaded_ = false;
     mutable DATrie<float> prediction_;
+    mutable PredictionTable predictionTable_;
+
+    void loadPrediction() const {
+        predictionLoaded_ = true;
+        try {
+            std::ifstream fin;
+            fin.open(file_ + ".predict", std::ios::in | std::ios::binary);
+            if (!fin) {
+                return;
+            }
+            try {
+                PredictionTable table;
+                table.load(fin);
+                predictionTable_ = std::move(table);
+                return;
+            } catch (const std::invalid_argument &) {
+            }
+            fin.clear();
+            fin.seekg(0);
+            DATrie<float> trie;
+            trie.load(fin);
+            prediction_ = std::move(trie);
+            convertLegacyPrediction();
+        } catch (...) {
+        }
+    }
+
+    // The legacy file stores the score of "prev|cur" as a whole, turn it into
+    // the score of cur given prev.
+    void convertLegacyPrediction() const {
+        std::unordered_map<std::string, PredictionTable::CandidateList> lists;
+        std::string buf;
+        prediction_.foreach(
+            [this, &lists, &buf](float value, size_t len,
+                                 DATrie<float>::position_type pos) {
+                prediction_.suffix(buf, len, pos);
+                auto sep = buf.find('|');
+                if (sep != std::string::npos) {
+                    lists[buf.substr(0, sep)].emplace_back(
+                        buf.substr(sep + 1), value);
+                }
+                return true;
+            });
+        lm::ngram::State null, out;
+        model_->NullContextWrite(&null);
+        const auto &vocab = model_->BaseVocabulary();
+        PredictionTable table;
+        for (auto &item : lists) {
+            auto prev = model_->BaseScore(
+                &null, vocab.Index(StringPiece{item.first}), &out);
+            for (auto &candidate : item.second) {
+                candidate.second -= prev;
+            }
+            table.set(item.first, std::move(item.second));
+        }
+        predictionTable_ = std::move(table);
+    }
 };
 
 StaticLanguageModelFile::StaticLanguageModelFile(const char *file) {
@@ -37,21 +108,19 @@ StaticLanguageModelFile::~StaticLanguageModelFile() {}
 const DATrie<float> &StaticLanguageModelFile::predictionTrie() const {
     FCITX_D();
     if (!d->predictionLoaded_) {
-        d->predictionLoaded_ = true;
-        try {
-            std::ifstream fin;
-            fin.open(d->file_ + ".predict", std::ios::in | std::ios::binary);
-            if (fin) {
-                DATrie<float> trie;
-                trie.load(fin);
-                d->prediction_ = std::move(trie);
-            }
-        } catch (...) {
-        }
+        d->loadPrediction();
     }
     return d->prediction_;
 }
 
+const PredictionTable &StaticLanguageModelFile::predictionTable() const {
+    FCITX_D();
+    if (!d->predictionLoaded_) {
+        d->loadPrediction();
+    }
+    return d->predictionTable_;
+}
+
 static_assert(sizeof(void *) + sizeof(lm::ngram::State) <= StateSize, "Size");
 
 bool LanguageModelBase::isNodeUnknown(const LatticeNode &node) const {
@@ -95,21 +164,58 @@ static inline const lm::ngram::State &lmState(const State &state) {
     return *reinterpret_cast<const lm::ngram::State *>(state.data());
 }
 
+struct LanguageModelScoreCacheEntry {
+    lm::ngram::State in_;
+    lm::ngram::State out_;
+    WordIndex idx_ = InvalidWordIndex;
+    float score_ = 0.0f;
+};
+
 class LanguageModelPrivate {
 public:
     LanguageModelPrivate(std::shared_ptr<const StaticLanguageModelFile> file)
-        : file_(file) {}
+        : file_(file),
+          trieModel_(file_ ? file_->d_func()->trieModel_ : nullptr) {}
 
-    auto *model() { return file_ ? &file_->d_func()->model_ : nullptr; }
+    auto *model() { return file_ ? file_->d_func()->model_.get() : nullptr; }
     const auto *model() const {
-        return file_ ? &file_->d_func()->model_ : nullptr;
+        return file_ ? file_->d_func()->model_.get() : nullptr;
+    }
+
+    float modelScore(const lm::ngram::State &in, WordIndex idx,
+                     lm::ngram::State &out) const {
+        if (trieModel_) {
+            return trieModel_->Score(in, idx, out);
+        }
+        return model()->BaseScore(&in, idx, &out);
+    }
+
+    float cachedScore(const lm::ngram::State &in, WordIndex idx,
+                      lm::ngram::State &out) const {
+        auto &entry =
+            scoreCache_[hash_value(in, idx) & (scoreCache_.size() - 1)];
+        if (entry.idx_ == idx && entry.in_ == in) {
+            ++scoreCacheHits_;
+            out = entry.out_;
+            return entry.score_;
+        }
+        ++scoreCacheMisses_;
+        entry.score_ = modelScore(in, idx, entry.out_);
+        entry.in_ = in;
+        entry.idx_ = idx;
+        out = entry.out_;
+        return entry.score_;
     }
 
     std::shared_ptr<const StaticLanguageModelFile> file_;
+    const lm::ngram::QuantArrayTrieModel *trieModel_;
     State beginState_;
     State nullState_;
     float unknown_ =
         std::log10(DEFAULT_LANGUAGE_MODEL_UNKNOWN_PROBABILITY_PENALTY);
+    mutable std::vector<LanguageModelScoreCacheEntry> scoreCache_;
+    mutable size_t scoreCacheHits_ = 0;
+    mutable size_t scoreCacheMisses_ = 0;
 };
 
 LanguageModel::LanguageModel(const char *file)
@@ -120,8 +226,8 @@ LanguageModel::LanguageModel(
     : LanguageModelBase(), d_ptr(std::make_unique<LanguageModelPrivate>(file)) {
     FCITX_D();
     if (d->model()) {
-        lmState(d->beginState_) = d->model()->BeginSentenceState();
-        lmState(d->nullState_) = d->model()->NullContextState();
+        d->model()->BeginSentenceWrite(&lmState(d->beginState_));
+        d->model()->NullContextWrite(&lmState(d->nullState_));
     }
 }
 
@@ -138,7 +244,7 @@ WordIndex LanguageModel::beginSentence() const {
     if (!d->model()) {
         return 0;
     }
-    auto &v = d->model()->GetVocabulary();
+    auto &v = d->model()->BaseVocabulary();
     return v.BeginSentence();
 }
 
@@ -147,7 +253,7 @@ WordIndex LanguageModel::endSentence() const {
     if (!d->model()) {
         return 0;
     }
-    auto &v = d->model()->GetVocabulary();
+    auto &v = d->model()->BaseVocabulary();
     return v.EndSentence();
 }
 
@@ -156,7 +262,7 @@ WordIndex LanguageModel::unknown() const {
     if (!d->model()) {
         return 0;
     }
-    auto &v = d->model()->GetVocabulary();
+    auto &v = d->model()->BaseVocabulary();
     return v.NotFound();
 }
 
@@ -165,7 +271,7 @@ WordIndex LanguageModel::index(std::string_view word) const {
     if (!d->model()) {
         return 0;
     }
-    auto &v = d->model()->GetVocabulary();
+    auto &v = d->model()->BaseVocabulary();
     return v.Index(StringPiece{word.data(), word.size()});
 }
 
@@ -186,8 +292,13 @@ float LanguageModel::score(const State &state, const WordNode &node,
     if (!d->model()) {
         return d->unknown_;
     }
-    return d->model()->Score(lmState(state), node.idx(), lmState(out)) +
-           (node.idx() == unknown() ? d->unknown_ : 0.0f);
+    float score;
+    if (d->scoreCache_.empty()) {
+        score = d->modelScore(lmState(state), node.idx(), lmState(out));
+    } else {
+        score = d->cachedScore(lmState(state), node.idx(), lmState(out));
+    }
+    return score + (node.idx() == unknown() ? d->unknown_ : 0.0f);
 }
 
 bool LanguageModel::isUnknown(WordIndex idx, std::string_view) const {
@@ -204,6 +315,43 @@ float LanguageModel::unknownPenalty() const {
     return d->unknown_;
 }
 
+void LanguageModel::setScoreCacheSize(size_t size) {
+    FCITX_D();
+    size_t slots = 0;
+    if (size) {
+        slots = 1;
+        while (slots < size) {
+            slots <<= 1;
+        }
+    }
+    d->scoreCache_.clear();
+    d->scoreCache_.resize(slots);
+    d->scoreCache_.shrink_to_fit();
+    d->scoreCacheHits_ = d->scoreCacheMisses_ = 0;
+}
+
+size_t LanguageModel::scoreCacheSize() const {
+    FCITX_D();
+    return d->scoreCache_.size();
+}
+
+void LanguageModel::clearScoreCache() {
+    FCITX_D();
+    std::fill(d->scoreCache_.begin(), d->scoreCache_.end(),
+              LanguageModelScoreCacheEntry());
+    d->scoreCacheHits_ = d->scoreCacheMisses_ = 0;
+}
+
+size_t LanguageModel::scoreCacheHits() const {
+    FCITX_D();
+    return d->scoreCacheHits_;
+}
+
+size_t LanguageModel::scoreCacheMisses() const {
+    FCITX_D();
+    return d->scoreCacheMisses_;
+}
+
 class LanguageModelResolverPrivate {
 public:
     std::unordered_map<std::string,
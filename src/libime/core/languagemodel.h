@@ -18,13 +18,16 @@ namespace libime {
 using WordIndex = unsigned int;
 constexpr const unsigned int InvalidWordIndex =
     std::numeric_limits<WordIndex>::max();
-constexpr size_t StateSize = 20 + sizeof(void *);
+// kenlm state, followed by the previous word and its cached history lookup
+// used by UserLanguageModel.
+constexpr size_t StateSize = 20 + sizeof(void *) + 16;
 using State = std::array<char, StateSize>;
 
 class WordNode;
 class LatticeNode;
 class LanguageModelPrivate;
 class LanguageModelResolverPrivate;
+class PredictionTable;
 
 class LIBIMECORE_EXPORT LanguageModelBase {
 public:
@@ -55,7 +58,13 @@ public:
     explicit StaticLanguageModelFile(const char *file);
     virtual ~StaticLanguageModelFile();
 
+    /// \brief Prediction data in the legacy format.
+    ///
+    /// Only filled if the .predict file is a plain trie, use predictionTable()
+    /// instead.
     const DATrie<float> &predictionTrie() const;
+    /// Prediction candidates loaded from the .predict file next to the model.
+    const PredictionTable &predictionTable() const;
 
 private:
     std::unique_ptr<StaticLanguageModelFilePrivate> d_ptr;
@@ -83,6 +92,19 @@ public:
     void setUnknownPenalty(float unknown);
     float unknownPenalty() const;
 
+    /// \brief Set the number of slots of the score cache.
+    ///
+    /// The cache memoizes the static model lookup for a pair of (state, word
+    /// index). It is direct mapped, so a newer entry simply replaces the older
+    /// one in the same slot. The size is rounded up to a power of two, and 0
+    /// disables the cache. The cache is not thread safe.
+    void setScoreCacheSize(size_t size);
+    size_t scoreCacheSize() const;
+    /// Drop all cached scores and reset the hit/miss counters.
+    void clearScoreCache();
+    size_t scoreCacheHits() const;
+    size_t scoreCacheMisses() const;
+
 private:
     std::unique_ptr<LanguageModelPrivate> d_ptr;
     FCITX_DECLARE_PRIVATE(LanguageModel);
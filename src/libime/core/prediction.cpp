@@ -7,10 +7,205 @@
 #include "prediction.h"
 #include "datrie.h"
 #include "historybigram.h"
+#include "lattice.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstring>
 #include <unordered_set>
 
 namespace libime {
 
+static constexpr uint32_t predictionBinaryFormatMagic = 0x000fc9d7;
+static constexpr uint32_t predictionBinaryFormatVersion = 0x2;
+
+namespace {
+
+template <typename T>
+void marshallVector(std::ostream &out, const std::vector<T> &data) {
+    throw_if_io_fail(marshall(out, static_cast<uint32_t>(data.size())));
+    for (auto value : data) {
+        throw_if_io_fail(marshall(out, value));
+    }
+}
+
+// Read the values in one go, and convert them in place.
+template <typename T>
+void unmarshallVector(std::istream &in, std::vector<T> &data) {
+    static_assert(sizeof(T) == sizeof(uint32_t), "Only for 4 byte data");
+    uint32_t size = 0;
+    throw_if_io_fail(unmarshall(in, size));
+    data.resize(size);
+    throw_if_io_fail(
+        in.read(reinterpret_cast<char *>(data.data()), sizeof(T) * size));
+    for (auto &value : data) {
+        uint32_t i;
+        memcpy(&i, &value, sizeof(i));
+        i = ntohl(i);
+        memcpy(&value, &i, sizeof(i));
+    }
+}
+
+bool isOffsets(const std::vector<uint32_t> &offsets, size_t size) {
+    return !offsets.empty() && offsets.front() == 0 &&
+           offsets.back() == size &&
+           std::is_sorted(offsets.begin(), offsets.end());
+}
+
+} // namespace
+
+class PredictionTablePrivate {
+public:
+    PredictionTable::CandidateRange range(uint32_t list) const {
+        if (list + 1 >= listOffsets_.size()) {
+            return {};
+        }
+        auto begin = listOffsets_[list];
+        return {words_.data(), wordOffsets_.data() + begin,
+                scores_.data() + begin, listOffsets_[list + 1] - begin};
+    }
+
+    template <typename T>
+    void append(std::string_view context, const T &candidates) {
+        for (const auto &candidate : candidates) {
+            words_.append(candidate.first.data(), candidate.first.size());
+            wordOffsets_.push_back(words_.size());
+            scores_.push_back(candidate.second);
+        }
+        auto list = listOffsets_.size() - 1;
+        listOffsets_.push_back(scores_.size());
+        auto value = index_.exactMatchSearch(context);
+        if (DATrie<uint32_t>::isValid(value)) {
+            unusedLists_++;
+        }
+        index_.set(context, list);
+    }
+
+    // Drop the lists of the contexts that are set again.
+    void compact() {
+        if (!unusedLists_) {
+            return;
+        }
+        PredictionTablePrivate compacted;
+        std::string context;
+        index_.foreach([this, &compacted, &context](
+                           uint32_t value, size_t len,
+                           DATrie<uint32_t>::position_type pos) {
+            index_.suffix(context, len, pos);
+            compacted.append(context, range(value));
+            return true;
+        });
+        *this = std::move(compacted);
+    }
+
+    // Map context to the index of its list.
+    DATrie<uint32_t> index_;
+    // Candidate i is words_[wordOffsets_[i], wordOffsets_[i + 1]) with
+    // scores_[i], and list k holds candidates [listOffsets_[k],
+    // listOffsets_[k + 1]).
+    std::string words_;
+    std::vector<uint32_t> wordOffsets_{0};
+    std::vector<float> scores_;
+    std::vector<uint32_t> listOffsets_{0};
+    // Lists left behind by contexts that are set again.
+    size_t unusedLists_ = 0;
+};
+
+PredictionTable::PredictionTable()
+    : d_ptr(std::make_unique<PredictionTablePrivate>()) {}
+
+FCITX_DEFINE_DEFAULT_DTOR_AND_MOVE(PredictionTable)
+
+void PredictionTable::load(std::istream &in) {
+    FCITX_D();
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    throw_if_io_fail(unmarshall(in, magic));
+    if (magic != predictionBinaryFormatMagic) {
+        throw std::invalid_argument("Invalid prediction magic.");
+    }
+    throw_if_io_fail(unmarshall(in, version));
+    if (version != predictionBinaryFormatVersion) {
+        throw std::invalid_argument("Invalid prediction version.");
+    }
+
+    PredictionTablePrivate table;
+    table.index_.load(in);
+    unmarshallVector(in, table.listOffsets_);
+    unmarshallVector(in, table.wordOffsets_);
+    unmarshallVector(in, table.scores_);
+    throw_if_io_fail(unmarshallString(in, table.words_));
+    if (!isOffsets(table.listOffsets_, table.scores_.size()) ||
+        !isOffsets(table.wordOffsets_, table.words_.size()) ||
+        table.wordOffsets_.size() != table.scores_.size() + 1) {
+        throw std::invalid_argument("Invalid prediction data.");
+    }
+    *d = std::move(table);
+}
+
+void PredictionTable::save(std::ostream &out) {
+    FCITX_D();
+    d->compact();
+    throw_if_io_fail(marshall(out, predictionBinaryFormatMagic));
+    throw_if_io_fail(marshall(out, predictionBinaryFormatVersion));
+    d->index_.save(out);
+    marshallVector(out, d->listOffsets_);
+    marshallVector(out, d->wordOffsets_);
+    marshallVector(out, d->scores_);
+    throw_if_io_fail(marshallString(out, d->words_));
+}
+
+void PredictionTable::clear() {
+    FCITX_D();
+    *d = PredictionTablePrivate();
+}
+
+void PredictionTable::set(std::string_view context, CandidateList candidates,
+                          size_t maxSize) {
+    FCITX_D();
+    std::sort(candidates.begin(), candidates.end(),
+              [](const auto &lhs, const auto &rhs) {
+                  if (lhs.second != rhs.second) {
+                      return lhs.second > rhs.second;
+                  }
+                  return lhs.first < rhs.first;
+              });
+    if (maxSize && candidates.size() > maxSize) {
+        candidates.resize(maxSize);
+    }
+    d->append(context, candidates);
+}
+
+PredictionTable::CandidateRange
+PredictionTable::candidates(std::string_view context) const {
+    FCITX_D();
+    auto value = d->index_.exactMatchSearch(context);
+    if (!DATrie<uint32_t>::isValid(value)) {
+        return {};
+    }
+    return d->range(value);
+}
+
+PredictionTable::CandidateRange
+PredictionTable::candidates(std::string_view prev2,
+                            std::string_view prev) const {
+    FCITX_D();
+    DATrie<uint32_t>::position_type pos = 0;
+    if (DATrie<uint32_t>::isNoPath(d->index_.traverse(prev2, pos)) ||
+        DATrie<uint32_t>::isNoPath(d->index_.traverse("|", pos))) {
+        return {};
+    }
+    auto value = d->index_.traverse(prev, pos);
+    if (!DATrie<uint32_t>::isValid(value)) {
+        return {};
+    }
+    return d->range(value);
+}
+
+size_t PredictionTable::size() const {
+    FCITX_D();
+    return d->listOffsets_.size() - 1 - d->unusedLists_;
+}
+
 class PredictionPrivate {
 public:
     const LanguageModel *model_ = nullptr;
@@ -53,67 +248,123 @@ Prediction::predict(const std::vector<std::string> &sentence,
 std::vector<std::string>
 Prediction::predict(const State &state,
                     const std::vector<std::string> &sentence,
-                    size_t realMaxSize) {
+                    size_t maxSize) {
+    PredictionBuffer buffer;
+    predict(state, sentence, maxSize, buffer);
+    std::vector<std::string> result;
+    for (const auto &candidate : buffer.candidates()) {
+        result.emplace_back(candidate.first);
+    }
+    return result;
+}
+
+namespace {
+
+bool candidateBetter(const PredictionBuffer::Candidate &lhs,
+                     const PredictionBuffer::Candidate &rhs) {
+    if (lhs.second != rhs.second) {
+        return lhs.second > rhs.second;
+    }
+    return lhs.first < rhs.first;
+}
+
+// The heap keeps the worst candidate at front, so it can be replaced once the
+// heap is full.
+void pushCandidate(std::vector<PredictionBuffer::Candidate> &heap,
+                   size_t maxSize, const PredictionBuffer::Candidate &item) {
+    if (heap.size() < maxSize) {
+        heap.push_back(item);
+        std::push_heap(heap.begin(), heap.end(), candidateBetter);
+    } else if (candidateBetter(item, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), candidateBetter);
+        heap.back() = item;
+        std::push_heap(heap.begin(), heap.end(), candidateBetter);
+    }
+}
+
+} // namespace
+
+void Prediction::predict(const State &state,
+                         const std::vector<std::string> &sentence,
+                         size_t maxSize, PredictionBuffer &buffer) {
     FCITX_D();
-    if (!d->model_) {
-        return {};
+    buffer.clear();
+    if (!d->model_ || maxSize == 0) {
+        return;
     }
-    // Search more get less.
-    size_t maxSize = realMaxSize * 2;
-    std::unordered_set<std::string> words;
 
-    if (auto file = d->model_->languageModelFile()) {
-        std::string search = "<unk>";
+    if (d->bigram_) {
+        std::string_view prev = "<s>";
         if (!sentence.empty()) {
-            search = sentence.back();
+            prev = sentence.back();
         }
-        search += "|";
-        auto &trie = file->predictionTrie();
-        trie.foreach(search, [&trie, &words,
-                              maxSize](DATrie<float>::value_type, size_t len,
-                                       DATrie<float>::position_type pos) {
-            std::string buf;
-            trie.suffix(buf, len, pos);
-            words.emplace(std::move(buf));
-
-            if (maxSize > 0 && words.size() >= maxSize) {
-                return false;
-            }
-            return true;
-        });
+        d->bigram_->foreachPredict(
+            prev, [&buffer, maxSize](std::string_view word) {
+                if (!buffer.words_.count(word)) {
+                    if (buffer.historySize_ == buffer.history_.size()) {
+                        buffer.history_.emplace_back();
+                    }
+                    auto &history = buffer.history_[buffer.historySize_++];
+                    history = word;
+                    buffer.words_.insert(history);
+                }
+                return buffer.historySize_ < maxSize;
+            });
     }
+    auto historyBegin = buffer.history_.begin();
+    auto historyEnd = historyBegin + buffer.historySize_;
 
-    if (d->bigram_) {
-        d->bigram_->fillPredict(words, sentence, maxSize);
+    // Words from history are scored by the model so the user's own input is
+    // taken into account, while the static candidates carry their score.
+    State outState;
+    for (auto iter = historyBegin; iter != historyEnd; ++iter) {
+        WordNode node(*iter, d->model_->index(*iter));
+        pushCandidate(buffer.candidates_, maxSize,
+                      {*iter, d->model_->score(state, node, outState)});
     }
 
-    std::vector<std::string> result;
-    if (!d->model_) {
-        result.insert(result.end(), words.begin(), words.end());
-        std::sort(result.begin(), result.end());
-    } else {
-        std::vector<std::pair<float, std::string>> temps;
-        for (auto word : words) {
-            auto score = d->model_->singleWordScore(state, word);
-            temps.emplace_back(score, std::move(word));
+    if (auto file = d->model_->languageModelFile()) {
+        const auto &table = file->predictionTable();
+        // Look up by the last two words, then the last word, then <unk>.
+        PredictionTable::CandidateRange lists[3];
+        if (sentence.size() >= 2) {
+            lists[0] = table.candidates(sentence[sentence.size() - 2],
+                                        sentence.back());
         }
-        std::sort(temps.begin(), temps.end(), [](auto &lhs, auto &rhs) {
-            if (lhs.first != rhs.first) {
-                return lhs.first > rhs.first;
-            } else {
-                return lhs.second < rhs.second;
-            }
-        });
-        for (auto &temp : temps) {
-            result.emplace_back(std::move(temp.second));
+        if (!sentence.empty()) {
+            lists[1] = table.candidates(sentence.back());
         }
-    }
+        lists[2] = table.candidates("<unk>");
 
-    if (result.size() > realMaxSize) {
-        result.resize(realMaxSize);
+        // The longest available context competes with history by score,
+        // shorter contexts only fill the remaining slots. Candidates are
+        // sorted, so stop at the first one that doesn't fit. A candidate is
+        // only dropped from the heap once it is full, and then no shorter
+        // context is used, so a word is skipped once it has been pushed.
+        bool fallback = false;
+        for (const auto &candidates : lists) {
+            if (candidates.empty()) {
+                continue;
+            }
+            for (const auto &candidate : candidates) {
+                PredictionBuffer::Candidate item(candidate.first,
+                                                 candidate.second);
+                if (buffer.candidates_.size() >= maxSize &&
+                    (fallback ||
+                     !candidateBetter(item, buffer.candidates_.front()))) {
+                    break;
+                }
+                if (!buffer.words_.insert(candidate.first).second) {
+                    continue;
+                }
+                pushCandidate(buffer.candidates_, maxSize, item);
+            }
+            fallback = true;
+        }
     }
 
-    return result;
+    std::sort_heap(buffer.candidates_.begin(), buffer.candidates_.end(),
+                   candidateBetter);
 }
 
 } // namespace libime
@@ -10,13 +10,161 @@
 #include "libime/core/userlanguagemodel.h"
 #include "libimecore_export.h"
 #include <fcitx-utils/macros.h>
+#include <cstdint>
+#include <deque>
+#include <iterator>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 namespace libime {
 
 class PredictionPrivate;
+class PredictionTablePrivate;
 class HistoryBigram;
 
+/// \brief Prediction candidates precomputed from the static language model.
+///
+/// The candidates of every context are stored sorted by score, so prediction
+/// only needs to take the first entries of a single lookup. All the words are
+/// kept in one buffer, and the table is saved as it is stored, so loading it
+/// reads the buffers back without building anything.
+class LIBIMECORE_EXPORT PredictionTable {
+public:
+    using Candidate = std::pair<std::string, float>;
+    using CandidateList = std::vector<Candidate>;
+
+    /// \brief Candidates of a context, sorted by score.
+    ///
+    /// The words point into the table, and are valid until it is changed.
+    class CandidateRange {
+    public:
+        using value_type = std::pair<std::string_view, float>;
+
+        class iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = CandidateRange::value_type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = value_type;
+
+            iterator() = default;
+            value_type operator*() const { return (*range_)[index_]; }
+            iterator &operator++() {
+                ++index_;
+                return *this;
+            }
+            iterator operator++(int) {
+                auto old = *this;
+                ++index_;
+                return old;
+            }
+            bool operator==(const iterator &other) const {
+                return index_ == other.index_;
+            }
+            bool operator!=(const iterator &other) const {
+                return index_ != other.index_;
+            }
+
+        private:
+            friend class CandidateRange;
+            iterator(const CandidateRange *range, size_t index)
+                : range_(range), index_(index) {}
+
+            const CandidateRange *range_ = nullptr;
+            size_t index_ = 0;
+        };
+
+        CandidateRange() = default;
+
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        value_type operator[](size_t i) const {
+            return {std::string_view(words_ + wordOffsets_[i],
+                                     wordOffsets_[i + 1] - wordOffsets_[i]),
+                    scores_[i]};
+        }
+        iterator begin() const { return {this, 0}; }
+        iterator end() const { return {this, size_}; }
+
+    private:
+        friend class PredictionTablePrivate;
+        CandidateRange(const char *words, const uint32_t *wordOffsets,
+                       const float *scores, size_t size)
+            : words_(words), wordOffsets_(wordOffsets), scores_(scores),
+              size_(size) {}
+
+        const char *words_ = nullptr;
+        const uint32_t *wordOffsets_ = nullptr;
+        const float *scores_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    PredictionTable();
+    FCITX_DECLARE_VIRTUAL_DTOR_MOVE(PredictionTable);
+
+    void load(std::istream &in);
+    void save(std::ostream &out);
+    void clear();
+
+    /// Set the candidates that follow context.
+    ///
+    /// The score is the log probability of the candidate given the context.
+    /// Candidates are sorted by score, and only the first maxSize of them are
+    /// kept if maxSize is not 0.
+    void set(std::string_view context, CandidateList candidates,
+             size_t maxSize = 0);
+
+    /// Return the candidates that follow context, sorted by score.
+    ///
+    /// A context of two words is stored as "prev2|prev".
+    CandidateRange candidates(std::string_view context) const;
+    /// Return the candidates that follow the two words, sorted by score.
+    CandidateRange candidates(std::string_view prev2,
+                              std::string_view prev) const;
+
+    /// Number of contexts.
+    size_t size() const;
+
+private:
+    std::unique_ptr<PredictionTablePrivate> d_ptr;
+    FCITX_DECLARE_PRIVATE(PredictionTable);
+};
+
+/// \brief Reusable result buffer of Prediction::predict.
+///
+/// Words point either into the prediction table of the language model file or
+/// into storage owned by the buffer. They are valid until the buffer is used
+/// again.
+class LIBIMECORE_EXPORT PredictionBuffer {
+public:
+    using Candidate = std::pair<std::string_view, float>;
+
+    /// Candidates sorted by score.
+    const std::vector<Candidate> &candidates() const { return candidates_; }
+    bool empty() const { return candidates_.empty(); }
+    size_t size() const { return candidates_.size(); }
+    void clear() {
+        candidates_.clear();
+        words_.clear();
+        historySize_ = 0;
+    }
+
+private:
+    friend class Prediction;
+    std::vector<Candidate> candidates_;
+    // Words from history, the strings are reused across calls. A deque keeps
+    // them in place when it grows, so words_ can point to them.
+    std::deque<std::string> history_;
+    size_t historySize_ = 0;
+    // Words already taken, to skip duplicates.
+    std::unordered_set<std::string_view> words_;
+};
+
 class LIBIMECORE_EXPORT Prediction {
 public:
     Prediction();
@@ -34,6 +182,18 @@ public:
     std::vector<std::string>
     predict(const std::vector<std::string> &sentence = {}, size_t maxSize = -1);
 
+    /// \brief Predict the words following sentence into buffer.
+    ///
+    /// state is the language model state after sentence. At most maxSize
+    /// candidates with the highest score are kept. Once the buffer has grown
+    /// large enough, only words from history are copied.
+    ///
+    /// Static candidates are looked up by the last two words of sentence.
+    /// If there are not enough of them, the last word and then <unk> are used
+    /// to fill the rest.
+    void predict(const State &state, const std::vector<std::string> &sentence,
+                 size_t maxSize, PredictionBuffer &buffer);
+
 private:
     std::unique_ptr<PredictionPrivate> d_ptr;
     FCITX_DECLARE_PRIVATE(Prediction);
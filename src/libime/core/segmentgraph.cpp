@@ -6,6 +6,7 @@
 
 #include "segmentgraph.h"
 #include "lattice_p.h"
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <boost/range/combine.hpp>
 #include <iostream>
@@ -148,4 +149,31 @@ void SegmentGraph::merge(SegmentGraph &graph,
         discardCallback(nodeToDiscard);
     }
 }
+
+std::unordered_set<const SegmentGraphNode *>
+SegmentGraph::resetFrom(size_t since, std::string str) {
+    assert(since <= size() && since <= str.size());
+    std::unordered_set<const SegmentGraphNode *> nodeToDiscard;
+    for (size_t i = since; i < graph_.size(); i++) {
+        for (auto &node : mutableNodes(i)) {
+            while (node.nextSize()) {
+                node.removeEdge(node.mutableNexts().front());
+            }
+            nodeToDiscard.insert(&node);
+        }
+    }
+    // Start is always kept, other nodes are only kept if still reached.
+    for (size_t i = std::max<size_t>(since, 1); i < graph_.size(); i++) {
+        if (graph_[i] && !graph_[i]->prevSize()) {
+            graph_[i].reset();
+        }
+    }
+
+    mutableData() = std::move(str);
+    resize(data().size() + 1);
+    if (!graph_[size()]) {
+        newNode(size());
+    }
+    return nodeToDiscard;
+}
 } // namespace libime
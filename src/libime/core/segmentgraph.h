@@ -250,6 +250,14 @@ public:
     void merge(SegmentGraph &graph,
                const DiscardCallback &discardCallback = {});
 
+    // Replace the data with str, which shares the first since bytes with it,
+    // and remove the edges from nodes at or after since. Nodes that are still
+    // the end of an edge from before since are kept, so only the edges from
+    // since need to be added again. Returns the nodes at or after since, as
+    // anything computed on them is outdated.
+    std::unordered_set<const SegmentGraphNode *> resetFrom(size_t since,
+                                                           std::string str);
+
     SegmentGraphNode &ensureNode(size_t idx) {
         if (nodes(idx).empty()) {
             newNode(idx);
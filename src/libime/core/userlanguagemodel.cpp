@@ -9,6 +9,11 @@
 #include "historybigram.h"
 #include "lm/model.hh"
 #include "utils.h"
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <type_traits>
 
 namespace libime {
 
@@ -16,13 +21,15 @@ class UserLanguageModelPrivate {
 public:
     State beginState_;
     State nullState_;
-    bool useOnlyUnigram_ = false;
+    // Settings are atomic, since they are read by score in any thread.
+    std::atomic<bool> useOnlyUnigram_{false};
 
     HistoryBigram history_;
-    float weight_ = DEFAULT_USER_LANGUAGE_MODEL_USER_WEIGHT;
+    std::atomic<float> weight_{DEFAULT_USER_LANGUAGE_MODEL_USER_WEIGHT};
     // log(wa * exp(a) + wb * exp(b))
     // log(exp(log(wa) + a) + exp(b + log(wb))
-    float wa_ = std::log10(1 - weight_), wb_ = std::log10(weight_);
+    std::atomic<float> wa_{std::log10(1 - weight_)},
+        wb_{std::log10(weight_)};
 
     const WordNode *wordFromState(const State &state) const {
         return load_data<const WordNode *>(reinterpret_cast<const char *>(
@@ -34,7 +41,30 @@ public:
             reinterpret_cast<char *>(state.data() + sizeof(lm::ngram::State)),
             node);
     }
+
+    // The history lookup of the word in state, so scoring the next word only
+    // needs to walk the next word itself.
+    static constexpr size_t contextOffset =
+        sizeof(lm::ngram::State) + sizeof(const WordNode *);
+
+    HistoryBigramContext contextFromState(const State &state) const {
+        HistoryBigramContext context;
+        std::memcpy(&context, state.data() + contextOffset, sizeof(context));
+        return context;
+    }
+
+    void setContextToState(State &state,
+                           const HistoryBigramContext &context) const {
+        std::memcpy(state.data() + contextOffset, &context, sizeof(context));
+    }
 };
+
+static_assert(std::is_trivially_copyable<HistoryBigramContext>::value,
+              "Context is stored in State as raw bytes");
+static_assert(UserLanguageModelPrivate::contextOffset +
+                      sizeof(HistoryBigramContext) <=
+                  StateSize,
+              "Size");
 UserLanguageModel::UserLanguageModel(const char *file)
     : UserLanguageModel(std::make_shared<StaticLanguageModelFile>(file)) {}
 
@@ -45,8 +75,10 @@ UserLanguageModel::UserLanguageModel(
     // resize will fill remaining with zero
     d->beginState_ = LanguageModel::beginState();
     d->setWordToState(d->beginState_, nullptr);
+    d->setContextToState(d->beginState_, {});
     d->nullState_ = LanguageModel::nullState();
     d->setWordToState(d->nullState_, nullptr);
+    d->setContextToState(d->nullState_, {});
 }
 
 UserLanguageModel::~UserLanguageModel() {}
@@ -63,10 +95,8 @@ const HistoryBigram &UserLanguageModel::history() const {
 
 void UserLanguageModel::load(std::istream &in) {
     FCITX_D();
-    HistoryBigram history;
-    history.setUnknownPenalty(d->history_.unknownPenalty());
-    history.load(in);
-    d->history_ = std::move(history);
+    // The history is replaced in place, as other threads may be using it.
+    d->history_.load(in);
 }
 void UserLanguageModel::save(std::ostream &out) {
     FCITX_D();
@@ -77,8 +107,8 @@ void UserLanguageModel::setHistoryWeight(float w) {
     FCITX_D();
     assert(w >= 0.0 && w <= 1.0);
     d->weight_ = w;
-    d->wa_ = std::log10(1 - d->weight_);
-    d->wb_ = std::log10(d->weight_);
+    d->wa_ = std::log10(1 - w);
+    d->wb_ = std::log10(w);
 }
 
 const State &UserLanguageModel::beginState() const {
@@ -91,15 +121,40 @@ const State &UserLanguageModel::nullState() const {
     return d->nullState_;
 }
 
-static const float log_10 = std::log(10);
-
 // log10(exp10(a) + exp10(b))
 //   = log10(exp10(b) * (1 + exp10(a - b)))
 //   = b + log10(1 + exp10(a - b))
-//   = b + log1p(exp10(a - b)) / log(10)
-inline float log1p10exp(float x) {
-    return x < MIN_FLOAT_LOG10 ? 0. : std::log1p(std::pow(10, x)) / log_10;
-}
+//
+// log10(1 + exp10(x)) for x <= 0 is read from a table with linear
+// interpolation. The error is below 5e-6. For x < -8 the exact value is less
+// than 5e-9, and 0 is returned.
+class Log1p10ExpTable {
+public:
+    Log1p10ExpTable() {
+        for (size_t i = 0; i < table_.size(); i++) {
+            table_[i] = std::log1p(std::pow(10.0, -static_cast<double>(i) /
+                                                      stepsPerUnit)) /
+                        std::log(10.0);
+        }
+    }
+
+    float operator()(float x) const {
+        float pos = -x * stepsPerUnit;
+        if (!(pos < range * stepsPerUnit)) {
+            return 0;
+        }
+        auto idx = static_cast<size_t>(pos);
+        return table_[idx] + (table_[idx + 1] - table_[idx]) * (pos - idx);
+    }
+
+private:
+    static constexpr int range = 8;
+    static constexpr int stepsPerUnit = 128;
+    std::array<float, range * stepsPerUnit + 1> table_;
+};
+
+static const Log1p10ExpTable log1p10exp;
+
 inline float sum_log_prob(float a, float b) {
     return a > b ? (a + log1p10exp(b - a)) : (b + log1p10exp(a - b));
 }
@@ -114,8 +169,12 @@ float UserLanguageModel::score(const State &state, const WordNode &word,
         score = LanguageModel::score(state, word, out);
     }
     auto prev = d->wordFromState(state);
-    float userScore = d->history_.score(prev, &word);
+    auto prevWord = prev ? std::string_view(prev->word()) : std::string_view();
+    HistoryBigramContext next;
+    float userScore = d->history_.score(d->contextFromState(state), prevWord,
+                                        word.word(), next);
     d->setWordToState(out, &word);
+    d->setContextToState(out, next);
     return std::max(score, sum_log_prob(score + d->wa_, userScore + d->wb_));
 }
 
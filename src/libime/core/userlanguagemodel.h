@@ -15,6 +15,11 @@ namespace libime {
 class UserLanguageModelPrivate;
 class HistoryBigram;
 
+/// \brief Language model combined with the user history.
+///
+/// Like HistoryBigram, it can be shared by many threads calling score, while
+/// one thread changes the history. The score cache of LanguageModel is not
+/// thread safe, and must be left disabled in that case.
 class LIBIMECORE_EXPORT UserLanguageModel : public LanguageModel {
 public:
     explicit UserLanguageModel(const char *sysfile);
@@ -39,6 +39,9 @@ public:
     int maxSentenceLength_ = -1;
     PinyinIME *ime_;
     SegmentGraph segs_;
+    // Only segments parsed from pinyin can be updated in place. A change of
+    // fuzzy flags clears the context, so they don't need to be tracked.
+    bool segsShuangpin_ = false;
     Lattice lattice_;
     PinyinMatchState matchState_;
     std::vector<SentenceResult> candidates_;
@@ -295,20 +298,28 @@ void PinyinContext::update() {
                 }
             }
         }
-        SegmentGraph newGraph;
-        if (auto spProfile = d->matchState_.shuangpinProfile()) {
-            newGraph = PinyinEncoder::parseUserShuangpin(
-                userInput().substr(start), *spProfile, d->ime_->fuzzyFlags());
-        } else {
-            newGraph = PinyinEncoder::parseUserPinyin(userInput().substr(start),
-                                                      d->ime_->fuzzyFlags());
-        }
-        d->segs_.merge(
-            newGraph,
+        auto discard =
             [d](const std::unordered_set<const SegmentGraphNode *> &nodes) {
                 d->lattice_.discardNode(nodes);
                 d->matchState_.discardNode(nodes);
-            });
+            };
+        auto spProfile = d->matchState_.shuangpinProfile();
+        if (!spProfile && !d->segsShuangpin_) {
+            discard(PinyinEncoder::updateUserPinyin(
+                d->segs_, userInput().substr(start), d->ime_->fuzzyFlags()));
+        } else {
+            SegmentGraph newGraph;
+            if (spProfile) {
+                newGraph = PinyinEncoder::parseUserShuangpin(
+                    userInput().substr(start), *spProfile,
+                    d->ime_->fuzzyFlags());
+            } else {
+                newGraph = PinyinEncoder::parseUserPinyin(
+                    userInput().substr(start), d->ime_->fuzzyFlags());
+            }
+            d->segs_.merge(newGraph, discard);
+        }
+        d->segsShuangpin_ = static_cast<bool>(spProfile);
         auto &graph = d->segs_;
 
         d->ime_->decoder()->decode(d->lattice_, d->segs_, d->ime_->nbest(),
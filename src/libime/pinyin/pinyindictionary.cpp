@@ -16,9 +16,11 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/unordered_map.hpp>
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <iomanip>
+#include <optional>
 #include <queue>
 #include <string_view>
 #include <type_traits>
@@ -155,16 +157,16 @@ public:
         PinyinMatchState *matchState)
         : graph_(graph), hasher_(graph), callback_(callback), ignore_(ignore),
           matchedPathsMap_(&matchState->d_func()->matchedPaths_),
-          nodeCacheMap_(&matchState->d_func()->nodeCacheMap_),
-          matchCacheMap_(&matchState->d_func()->matchCacheMap_),
+          matchCache_(matchState->d_func()->matchCache()),
           flags_(matchState->fuzzyFlags()),
           spProfile_(matchState->shuangpinProfile()),
-          partialLongWordLimit_(matchState->partialLongWordLimit()) {}
+          partialLongWordLimit_(matchState->partialLongWordLimit()),
+          frameSize_(matchState->frameSize()) {}
 
     explicit PinyinMatchContext(
         const SegmentGraph &graph, const GraphMatchCallback &callback,
         const std::unordered_set<const SegmentGraphNode *> &ignore,
-        NodeToMatchedPinyinPathsMap &matchedPaths)
+        MatchedPinyinPathStore &matchedPaths)
         : graph_(graph), hasher_(graph), callback_(callback), ignore_(ignore),
           matchedPathsMap_(&matchedPaths) {}
 
@@ -175,14 +177,117 @@ public:
 
     const GraphMatchCallback &callback_;
     const std::unordered_set<const SegmentGraphNode *> &ignore_;
-    NodeToMatchedPinyinPathsMap *matchedPathsMap_;
-    PinyinTrieNodeCache *nodeCacheMap_ = nullptr;
-    PinyinMatchResultCache *matchCacheMap_ = nullptr;
+    MatchedPinyinPathStore *matchedPathsMap_;
+    PinyinMatchCache *matchCache_ = nullptr;
     PinyinFuzzyFlags flags_{PinyinFuzzyFlag::None};
     std::shared_ptr<const ShuangpinProfile> spProfile_;
     size_t partialLongWordLimit_ = 0;
+    size_t frameSize_ = 0;
 };
 
+// A word under a pinyin prefix, with the cost used to sort it. rest_ is the
+// key of the word after the prefix, which is only the hanzi unless long words
+// are matched. A droppable_ word is a single syllable unknown to the model,
+// which the decoder drops in the middle of the input unless it is the first
+// word for the segments.
+struct PinyinSortedEntry {
+    float value_;
+    float cost_;
+    std::string rest_;
+    WordIndex index_;
+    bool droppable_;
+};
+
+// The cheapest words under a pinyin prefix, sorted by cost. They end at the
+// limit_-th word that is not droppable, so the droppable ones do not take the
+// place of a word the decoder keeps, and they are all the words if complete_.
+struct PinyinSortedEntries {
+    size_t limit_ = 0;
+    bool complete_ = false;
+    std::vector<PinyinSortedEntry> entries_;
+};
+
+// Sorted words of each trie, keyed by their encoded pinyin prefix. Unlike a
+// trie position, a prefix stays valid when a word is added or removed, so the
+// words are updated in place instead of being dropped.
+struct PinyinSortedIndex {
+    static constexpr size_t size = 256;
+
+    auto &entries(bool matchLongWord) {
+        return matchLongWord ? longWords_ : words_;
+    }
+
+    void erase(const PinyinTrie *trie) {
+        words_.erase(trie);
+        longWords_.erase(trie);
+    }
+
+    void clear() {
+        words_.clear();
+        longWords_.clear();
+    }
+
+    PinyinTrieSharedCache<const PinyinSortedEntries> words_{size};
+    PinyinTrieSharedCache<const PinyinSortedEntries> longWords_{size};
+};
+
+template <typename T>
+bool costGreater(const T &lhs, const T &rhs) {
+    return lhs.cost_ > rhs.cost_;
+}
+
+// Return sorted with the word of rest set to value, or removed if there is no
+// value. Return nullptr if the cheapest words are no longer known.
+std::shared_ptr<const PinyinSortedEntries>
+updateSortedEntries(const std::shared_ptr<const PinyinSortedEntries> &sorted,
+                    std::string_view rest, std::optional<float> value,
+                    float cost, WordIndex index, bool droppable) {
+    const auto &entries = sorted->entries_;
+    auto iter = std::find_if(entries.begin(), entries.end(),
+                             [rest](const PinyinSortedEntry &entry) {
+                                 return entry.rest_ == rest;
+                             });
+    const bool found = iter != entries.end();
+    // The words after the last entry are unknown, so unless there is none, a
+    // word may only take a place that is not after the last one.
+    const bool fits = value && (sorted->complete_ || entries.empty() ||
+                                cost >= entries.back().cost_);
+    if (!fits && !sorted->complete_) {
+        return found ? nullptr : sorted;
+    }
+    if (!value && !found) {
+        return sorted;
+    }
+
+    auto updated = std::make_shared<PinyinSortedEntries>(*sorted);
+    auto &updatedEntries = updated->entries_;
+    if (found) {
+        updatedEntries.erase(updatedEntries.begin() +
+                             (iter - entries.begin()));
+    }
+    if (value) {
+        PinyinSortedEntry entry{*value, cost, std::string(rest), index,
+                                droppable};
+        auto pos = std::upper_bound(updatedEntries.begin(),
+                                    updatedEntries.end(), entry,
+                                    costGreater<PinyinSortedEntry>);
+        updatedEntries.insert(pos, std::move(entry));
+        size_t kept = std::count_if(updatedEntries.begin(),
+                                    updatedEntries.end(),
+                                    [](const PinyinSortedEntry &entry) {
+                                        return !entry.droppable_;
+                                    });
+        // Unless all the words are kept, end at the last word not droppable.
+        while (kept > updated->limit_ ||
+               (!updated->complete_ && updatedEntries.back().droppable_)) {
+            kept -= updatedEntries.back().droppable_ ? 0 : 1;
+            updatedEntries.pop_back();
+            updated->complete_ = false;
+        }
+    }
+    return updated;
+}
+
 class PinyinDictionaryPrivate : fcitx::QPtrHolder<PinyinDictionary> {
 public:
     PinyinDictionaryPrivate(PinyinDictionary *q)
@@ -200,13 +305,49 @@ public:
     bool matchWords(const PinyinMatchContext &context,
                     const MatchedPinyinPaths &newPaths) const;
     bool matchWordsForOnePath(const PinyinMatchContext &context,
-                              const MatchedPinyinPath &path) const;
+                              const MatchedPinyinPath &path,
+                              const SegmentGraphPath &nodes) const;
 
     void matchNode(const PinyinMatchContext &context,
                    const SegmentGraphNode &currentNode) const;
 
+    // Call callback on the words under the trie positions of path, with their
+    // word index. If limit is not 0, only on the limit cheapest ones under
+    // each position that the decoder can not drop, and the droppable ones
+    // cheaper than them.
+    template <typename T>
+    void matchWordsOnTrie(const MatchedPinyinPath &path, bool matchLongWord,
+                          size_t limit, const T &callback) const;
+
+    // The cheapest words under pos, which is reached by pinyin on trie.
+    std::shared_ptr<const PinyinSortedEntries>
+    sortedEntries(const PinyinTrie &trie, const std::string &pinyin,
+                  uint64_t pos, bool matchLongWord, size_t limit) const;
+
+    // Update the sorted index of trie after key is set to value, or removed
+    // if there is no value.
+    void updateSortedIndex(const PinyinTrie *trie, std::string_view key,
+                           std::optional<float> value);
+
+    WordIndex wordIndex(std::string_view hanzi) const {
+        return model_ ? model_->index(hanzi) : InvalidWordIndex;
+    }
+
+    // Whether the decoder may drop a word with index and the encoded pinyin of
+    // pinyinSize, see PinyinDecoder::createLatticeNodeImpl.
+    bool droppable(size_t pinyinSize, WordIndex index) const {
+        return pinyinSize == 2 && model_ && index == model_->unknown();
+    }
+
     fcitx::ScopedConnection conn_;
+    fcitx::ScopedConnection changedConn_;
     std::vector<PinyinDictFlags> flags_;
+    const LanguageModelBase *model_ = nullptr;
+    // Built on demand for the positions with a limit on their words.
+    mutable PinyinSortedIndex sortedIndex_;
+    // Set while addWord or removeWord change a trie, as they update the
+    // sorted index themselves.
+    bool updatingWord_ = false;
 };
 
 void PinyinDictionaryPrivate::addEmptyMatch(
@@ -219,28 +360,47 @@ void PinyinDictionaryPrivate::addEmptyMatch(
         !boost::starts_with(
             graph.segment(currentNode.index(), currentNode.index() + 1),
             "\'")) {
-        SegmentGraphPath vec;
+        auto &matchedPathsMap = *context.matchedPathsMap_;
+        auto step = MatchedPinyinPathStore::noStep;
+        const SegmentGraphNode *start = &currentNode;
+        uint32_t pathSize = 1;
         if (auto prev = prevIsSeparator(graph, currentNode)) {
-            vec.push_back(prev);
+            step = matchedPathsMap.addStep(step, prev);
+            start = prev;
+            pathSize++;
         }
 
-        vec.push_back(&currentNode);
+        step = matchedPathsMap.addStep(step, &currentNode);
         for (size_t i = 0; i < q->dictSize(); i++) {
             if (flags_[i].test(PinyinDictFlag::FullMatch) &&
                 &currentNode != &graph.start()) {
                 continue;
             }
             auto &trie = *q->trie(i);
-            currentMatches.emplace_back(&trie, 0, vec, flags_[i]);
+            currentMatches.emplace_back(&trie, 0, step, pathSize, start,
+                                        flags_[i]);
             currentMatches.back().triePositions().emplace_back(0, 0);
         }
     }
 }
 
+static_assert(PinyinEncoder::lastFinal - PinyinEncoder::firstFinal < 64,
+              "Finals need to fit in a 64 bit mask.");
+
+// Bit mask of the finals that can follow pos on trie, bit i stands for final
+// PinyinEncoder::firstFinal + i.
+uint64_t finalsOnTrie(const PinyinTrie &trie, uint64_t pos) {
+    constexpr uint64_t allFinals =
+        (1ULL << (PinyinEncoder::lastFinal - PinyinEncoder::firstFinal + 1)) -
+        1;
+    return trie.childMask(pos, PinyinEncoder::firstFinal) & allFinals;
+}
+
 PinyinTriePositions
 traverseAlongPathOneStepBySyllables(const MatchedPinyinPath &path,
                                     const MatchedPinyinSyllables &syls) {
     PinyinTriePositions positions;
+    const auto &trie = *path.trie();
     for (const auto &pr : path.triePositions()) {
         uint64_t _pos;
         size_t fuzzies;
@@ -249,30 +409,43 @@ traverseAlongPathOneStepBySyllables(const MatchedPinyinPath &path,
             // make a copy
             auto pos = _pos;
             auto initial = static_cast<char>(syl.first);
-            auto result = path.trie()->traverse(&initial, 1, pos);
+            auto result = trie.traverse(&initial, 1, pos);
             if (PinyinTrie::isNoPath(result)) {
                 continue;
             }
             const auto &finals = syl.second;
 
-            auto updateNext = [fuzzies, &path, &positions](auto finalPair,
-                                                           auto pos) {
-                auto final = static_cast<char>(finalPair.first);
-                auto result = path.trie()->traverse(&final, 1, pos);
-
+            auto updateNext = [fuzzies, &trie, &positions, pos](char final,
+                                                                bool fuzzy) {
+                auto next = pos;
+                auto result = trie.traverse(&final, 1, next);
                 if (!PinyinTrie::isNoPath(result)) {
-                    size_t newFuzzies = fuzzies + (finalPair.second ? 1 : 0);
-                    positions.emplace_back(pos, newFuzzies);
+                    positions.emplace_back(next, fuzzies + (fuzzy ? 1 : 0));
                 }
             };
-            if (finals.size() > 1 || finals[0].first != PinyinFinal::Invalid) {
+            if (finals.size() == 1 && finals[0].first != PinyinFinal::Invalid) {
+                updateNext(static_cast<char>(finals[0].first),
+                           finals[0].second);
+                continue;
+            }
+
+            // Check the candidate finals against the children of pos, instead
+            // of traversing each of them.
+            auto mask = finalsOnTrie(trie, pos);
+            if (finals.size() > 1) {
                 for (auto final : finals) {
-                    updateNext(final, pos);
+                    auto c = static_cast<char>(final.first);
+                    if (PinyinEncoder::isValidFinal(c) &&
+                        (mask >> (c - PinyinEncoder::firstFinal)) & 1) {
+                        updateNext(c, final.second);
+                    }
                 }
             } else {
-                for (char test = PinyinEncoder::firstFinal;
-                     test <= PinyinEncoder::lastFinal; test++) {
-                    updateNext(std::make_pair(test, true), pos);
+                for (char test = PinyinEncoder::firstFinal; mask;
+                     test++, mask >>= 1) {
+                    if (mask & 1) {
+                        updateNext(test, true);
+                    }
                 }
             }
         }
@@ -280,53 +453,164 @@ traverseAlongPathOneStepBySyllables(const MatchedPinyinPath &path,
     return positions;
 }
 
+std::shared_ptr<const PinyinSortedEntries>
+PinyinDictionaryPrivate::sortedEntries(const PinyinTrie &trie,
+                                       const std::string &pinyin, uint64_t pos,
+                                       bool matchLongWord, size_t limit) const {
+    auto &cache = sortedIndex_.entries(matchLongWord);
+    auto sorted = cache.find(&trie, pinyin);
+    if (sorted && (sorted->complete_ || sorted->limit_ >= limit)) {
+        return sorted;
+    }
+
+    struct Candidate {
+        float value_;
+        float cost_;
+        size_t len_;
+        uint64_t pos_;
+    };
+    std::vector<Candidate> candidates;
+    std::string rest;
+    trie.foreach(
+        [&trie, &candidates, &rest,
+         matchLongWord](PinyinTrie::value_type value, size_t len,
+                        uint64_t pos) {
+            float cost = value;
+            if (matchLongWord) {
+                trie.suffix(rest, len, pos);
+                size_t separator = rest.find(pinyinHanziSep);
+                if (separator == std::string::npos) {
+                    return true;
+                }
+                cost += fuzzyCost * (separator / 2);
+            }
+            candidates.push_back({value, cost, len, pos});
+            return true;
+        },
+        pos);
+
+    auto updated = std::make_shared<PinyinSortedEntries>();
+    updated->limit_ = limit;
+    // Only the words that are kept are read, and resolved in the model. Sort
+    // the next cheapest words until limit of them can not be dropped.
+    auto &entries = updated->entries_;
+    size_t kept = 0;
+    while (kept < limit && entries.size() < candidates.size()) {
+        auto begin = candidates.begin() + entries.size();
+        auto end = begin + std::min<size_t>(limit - kept,
+                                            candidates.end() - begin);
+        std::partial_sort(begin, end, candidates.end(),
+                          costGreater<Candidate>);
+        for (auto iter = begin; iter != end; ++iter) {
+            trie.suffix(rest, iter->len_, iter->pos_);
+            std::string_view hanzi = rest;
+            size_t pinyinSize = pinyin.size();
+            if (matchLongWord) {
+                size_t separator = rest.find(pinyinHanziSep);
+                hanzi = hanzi.substr(separator + 1);
+                pinyinSize += separator;
+            }
+            WordIndex index = wordIndex(hanzi);
+            bool isDroppable = droppable(pinyinSize, index);
+            entries.push_back(
+                {iter->value_, iter->cost_, rest, index, isDroppable});
+            kept += isDroppable ? 0 : 1;
+        }
+    }
+    updated->complete_ = entries.size() == candidates.size();
+    cache.insert(&trie, pinyin, updated);
+    return updated;
+}
+
+void PinyinDictionaryPrivate::updateSortedIndex(const PinyinTrie *trie,
+                                                std::string_view key,
+                                                std::optional<float> value) {
+    size_t separator = key.find(pinyinHanziSep);
+    if (separator == std::string_view::npos) {
+        return;
+    }
+    auto hanzi = key.substr(separator + 1);
+    WordIndex index = wordIndex(hanzi);
+    bool isDroppable = droppable(separator, index);
+    using SortedEntriesPtr = std::shared_ptr<const PinyinSortedEntries>;
+    auto update = [value, index, isDroppable](std::string_view rest,
+                                              float cost) {
+        return [value, index, isDroppable, rest,
+                cost](const SortedEntriesPtr &sorted) {
+            return updateSortedEntries(sorted, rest, value, cost, index,
+                                       isDroppable);
+        };
+    };
+
+    const float cost = value.value_or(0.0f);
+    sortedIndex_.words_.update(trie, std::string(key.substr(0, separator)),
+                               update(hanzi, cost));
+    // Every prefix of syllables may match the word as a long word.
+    for (size_t i = 2; i <= separator; i += 2) {
+        sortedIndex_.longWords_.update(
+            trie, std::string(key.substr(0, i)),
+            update(key.substr(i), cost + fuzzyCost * ((separator - i) / 2)));
+    }
+}
+
 template <typename T>
-void matchWordsOnTrie(const MatchedPinyinPath &path, bool matchLongWord,
-                      const T &callback) {
+void PinyinDictionaryPrivate::matchWordsOnTrie(const MatchedPinyinPath &path,
+                                               bool matchLongWord, size_t limit,
+                                               const T &callback) const {
+    const auto &trie = *path.trie();
+    const size_t pinyinSize = path.size() * 2;
+    // Every word under a position shares the encoded pinyin leading to it, so
+    // it is read once, and only the rest of each entry is read from the trie.
+    std::string encodedPinyin;
+    std::string rest;
     for (auto &pr : path.triePositions()) {
         uint64_t pos;
         size_t fuzzies;
         std::tie(pos, fuzzies) = pr;
         float extraCost = fuzzies * fuzzyCost;
-        if (matchLongWord) {
-            path.trie()->foreach(
-                [&path, &callback, extraCost](PinyinTrie::value_type value,
-                                              size_t len, uint64_t pos) {
-                    std::string s;
-                    s.reserve(len + path.size() * 2);
-                    path.trie()->suffix(s, len + path.size() * 2, pos);
-                    if (size_t separator =
-                            s.find(pinyinHanziSep, path.size() * 2);
-                        separator != std::string::npos) {
-                        std::string_view view(s);
-                        auto encodedPinyin = view.substr(0, separator);
-                        auto hanzi = view.substr(separator + 1);
-                        float overLengthCost =
-                            fuzzyCost *
-                            (encodedPinyin.size() / 2 - path.size());
-                        callback(encodedPinyin, hanzi,
-                                 value + extraCost + overLengthCost);
-                    }
-                    return true;
-                },
-                pos);
-        } else {
+        trie.suffix(encodedPinyin, pinyinSize, pos);
+        if (!matchLongWord) {
             const char sep = pinyinHanziSep;
-            auto result = path.trie()->traverse(&sep, 1, pos);
+            auto result = trie.traverse(&sep, 1, pos);
             if (PinyinTrie::isNoPath(result)) {
                 continue;
             }
+        }
 
-            path.trie()->foreach(
-                [&path, &callback, extraCost](PinyinTrie::value_type value,
-                                              size_t len, uint64_t pos) {
-                    std::string s;
-                    s.reserve(len + path.size() * 2 + 1);
-                    path.trie()->suffix(s, len + path.size() * 2 + 1, pos);
-                    std::string_view view(s);
-                    auto encodedPinyin = view.substr(0, path.size() * 2);
-                    auto hanzi = view.substr(path.size() * 2 + 1);
-                    callback(encodedPinyin, hanzi, value + extraCost);
+        // index returns the word index of the hanzi of rest.
+        auto matchEntry = [&callback, &encodedPinyin, pinyinSize, matchLongWord,
+                           extraCost](float value, std::string_view rest,
+                                      const auto &index) {
+            if (!matchLongWord) {
+                callback(encodedPinyin, rest, value + extraCost, index(rest));
+                return;
+            }
+            if (size_t separator = rest.find(pinyinHanziSep);
+                separator != std::string_view::npos) {
+                encodedPinyin.resize(pinyinSize);
+                encodedPinyin.append(rest.data(), separator);
+                auto hanzi = rest.substr(separator + 1);
+                float overLengthCost = fuzzyCost * (separator / 2);
+                callback(encodedPinyin, hanzi,
+                         value + extraCost + overLengthCost, index(hanzi));
+            }
+        };
+
+        if (limit) {
+            auto sorted =
+                sortedEntries(trie, encodedPinyin, pos, matchLongWord, limit);
+            for (const auto &entry : sorted->entries_) {
+                matchEntry(entry.value_, entry.rest_,
+                           [&entry](std::string_view) { return entry.index_; });
+            }
+        } else {
+            trie.foreach(
+                [this, &trie, &matchEntry, &rest](PinyinTrie::value_type value,
+                                                  size_t len, uint64_t pos) {
+                    trie.suffix(rest, len, pos);
+                    matchEntry(value, rest, [this](std::string_view hanzi) {
+                        return wordIndex(hanzi);
+                    });
                     return true;
                 },
                 pos);
@@ -335,14 +619,15 @@ void matchWordsOnTrie(const MatchedPinyinPath &path, bool matchLongWord,
 }
 
 bool PinyinDictionaryPrivate::matchWordsForOnePath(
-    const PinyinMatchContext &context, const MatchedPinyinPath &path) const {
+    const PinyinMatchContext &context, const MatchedPinyinPath &path,
+    const SegmentGraphPath &nodes) const {
     bool matched = false;
-    assert(path.path_.size() >= 2);
-    const SegmentGraphNode &prevNode = *path.path_[path.path_.size() - 2];
+    assert(nodes.size() >= 2);
+    const SegmentGraphNode &prevNode = *nodes[nodes.size() - 2];
 
     if (path.flags_.test(PinyinDictFlag::FullMatch) &&
-        (path.path_.front() != &context.graph_.start() ||
-         path.path_.back() != &context.graph_.end())) {
+        (nodes.front() != &context.graph_.start() ||
+         nodes.back() != &context.graph_.end())) {
         return false;
     }
 
@@ -350,39 +635,51 @@ bool PinyinDictionaryPrivate::matchWordsForOnePath(
     const bool matchLongWordEnabled =
         context.partialLongWordLimit_ &&
         std::max(minimumLongWordLength, context.partialLongWordLimit_) + 1 <=
-            path.path_.size() &&
+            nodes.size() &&
         !path.flags_.test(PinyinDictFlag::FullMatch);
 
     const bool matchLongWord =
-        (path.path_.back() == &context.graph_.end() && matchLongWordEnabled);
+        (nodes.back() == &context.graph_.end() && matchLongWordEnabled);
 
-    auto foundOneWord = [&path, &prevNode, &matched,
+    auto foundOneWord = [&path, &nodes, &prevNode, &matched,
                          &context](std::string_view encodedPinyin,
                                    WordNode &word, float cost) {
         context.callback_(
-            path.path_, word, cost,
+            nodes, word, cost,
             std::make_unique<PinyinLatticeNodePrivate>(encodedPinyin));
-        if (path.size() == 1 &&
-            path.path_[path.path_.size() - 2] == &prevNode) {
+        if (path.size() == 1 && nodes[nodes.size() - 2] == &prevNode) {
             matched = true;
         }
     };
 
-    if (context.matchCacheMap_) {
-        auto &matchCache = (*context.matchCacheMap_)[path.trie()];
-        auto result =
-            matchCache.find(path.path_, context.hasher_, context.hasher_);
+    // Unless the segments start at the beginning, the decoder stops after it
+    // keeps frameSize + 1 words for them, and drops unknown single syllables
+    // but the first word. The words are matched cheapest first, up to the
+    // limit-th one that can not be dropped, so the decoder keeps the same
+    // words of this path as if all were matched. The places are still shared
+    // with the other paths of the same segments.
+    const size_t limit =
+        context.frameSize_ && nodes.front() != &context.graph_.start()
+            ? context.frameSize_ + 1
+            : 0;
+
+    if (context.matchCache_ && !limit) {
+        auto &matchCache =
+            context.matchCache_->results(matchLongWordEnabled);
+        auto result = matchCache.find(path.trie(), nodes, context.hasher_,
+                                      context.hasher_);
         if (!result) {
-            result =
-                matchCache.insert(context.hasher_.pathToPinyins(path.path_));
-            result->clear();
-
-            auto &items = *result;
-            matchWordsOnTrie(path, matchLongWordEnabled,
+            auto items = std::make_shared<std::vector<PinyinMatchResult>>();
+            matchWordsOnTrie(path, matchLongWordEnabled, 0,
                              [&items](std::string_view encodedPinyin,
-                                      std::string_view hanzi, float cost) {
-                                 items.emplace_back(hanzi, cost, encodedPinyin);
+                                      std::string_view hanzi, float cost,
+                                      WordIndex index) {
+                                 items->emplace_back(hanzi, cost, encodedPinyin,
+                                                     index);
                              });
+            matchCache.insert(path.trie(), context.hasher_.pathToPinyins(nodes),
+                              items);
+            result = std::move(items);
         }
         for (auto &item : *result) {
             if (!matchLongWord &&
@@ -392,10 +689,11 @@ bool PinyinDictionaryPrivate::matchWordsForOnePath(
             foundOneWord(item.encodedPinyin_, item.word_, item.value_);
         }
     } else {
-        matchWordsOnTrie(path, matchLongWord,
+        matchWordsOnTrie(path, matchLongWord, limit,
                          [&foundOneWord](std::string_view encodedPinyin,
-                                         std::string_view hanzi, float cost) {
-                             WordNode word(hanzi, InvalidWordIndex);
+                                         std::string_view hanzi, float cost,
+                                         WordIndex index) {
+                             WordNode word(hanzi, index);
                              foundOneWord(encodedPinyin, word, cost);
                          });
     }
@@ -407,8 +705,10 @@ bool PinyinDictionaryPrivate::matchWords(
     const PinyinMatchContext &context,
     const MatchedPinyinPaths &newPaths) const {
     bool matched = false;
+    SegmentGraphPath nodes;
     for (const auto &path : newPaths) {
-        matched |= matchWordsForOnePath(context, path);
+        context.matchedPathsMap_->path(path, nodes);
+        matched |= matchWordsForOnePath(context, path, nodes);
     }
 
     return matched;
@@ -426,10 +726,10 @@ void PinyinDictionaryPrivate::findMatchesBetween(
     if (boost::starts_with(pinyin, "\'")) {
         const auto &prevMatches = matchedPathsMap[&prevNode];
         for (auto &match : prevMatches) {
-            // copy the path, and append current node.
-            auto path = match.path_;
-            path.push_back(&currentNode);
-            currentMatches.emplace_back(match.result_, std::move(path),
+            // share the path, and append current node.
+            auto step = matchedPathsMap.addStep(match.step_, &currentNode);
+            currentMatches.emplace_back(match.result_, step,
+                                        match.pathSize_ + 1, match.start_,
                                         match.flags_);
         }
         // If the last segment is separator, there
@@ -440,49 +740,53 @@ void PinyinDictionaryPrivate::findMatchesBetween(
         return;
     }
 
-    const auto syls =
-        context.spProfile_
-            ? PinyinEncoder::shuangpinToSyllables(pinyin, *context.spProfile_,
-                                                  context.flags_)
-            : PinyinEncoder::stringToSyllables(pinyin, context.flags_);
+    MatchedPinyinSyllables shuangpinSyls;
+    const MatchedPinyinSyllables *pSyls;
+    if (context.spProfile_) {
+        shuangpinSyls = PinyinEncoder::shuangpinToSyllables(
+            pinyin, *context.spProfile_, context.flags_);
+        pSyls = &shuangpinSyls;
+    } else {
+        pSyls = &PinyinEncoder::cachedStringToSyllables(pinyin, context.flags_);
+    }
+    const auto &syls = *pSyls;
     const MatchedPinyinPaths &prevMatchedPaths = matchedPathsMap[&prevNode];
     MatchedPinyinPaths newPaths;
+    SegmentGraphPath segmentPath;
     for (auto &path : prevMatchedPaths) {
-        // Make a copy of path so we can modify based on it.
-        auto segmentPath = path.path_;
-        segmentPath.push_back(&currentNode);
-
         // A map from trie (dict) to a lru cache.
-        if (context.nodeCacheMap_) {
-            auto &nodeCache = (*context.nodeCacheMap_)[path.trie()];
-            auto p =
-                nodeCache.find(segmentPath, context.hasher_, context.hasher_);
-            std::shared_ptr<MatchedPinyinTrieNodes> result;
-            if (!p) {
+        if (context.matchCache_) {
+            matchedPathsMap.path(path, segmentPath);
+            segmentPath.push_back(&currentNode);
+            auto &nodeCache = context.matchCache_->nodes_;
+            auto result = nodeCache.find(path.trie(), segmentPath,
+                                         context.hasher_, context.hasher_);
+            if (!result) {
                 result = std::make_shared<MatchedPinyinTrieNodes>(
                     path.trie(), path.size() + 1);
-                nodeCache.insert(context.hasher_.pathToPinyins(segmentPath),
-                                 result);
                 result->triePositions_ =
                     traverseAlongPathOneStepBySyllables(path, syls);
+                nodeCache.insert(path.trie(),
+                                 context.hasher_.pathToPinyins(segmentPath),
+                                 result);
             } else {
-                result = *p;
                 assert(result->size_ == path.size() + 1);
             }
 
             if (result->triePositions_.size()) {
-                newPaths.emplace_back(result, segmentPath, path.flags_);
+                newPaths.emplace_back(
+                    result, matchedPathsMap.addStep(path.step_, &currentNode),
+                    path.pathSize_ + 1, path.start_, path.flags_);
             }
         } else {
-            // make an empty one
-            newPaths.emplace_back(path.trie(), path.size() + 1, segmentPath,
-                                  path.flags_);
-
-            newPaths.back().result_->triePositions_ =
-                traverseAlongPathOneStepBySyllables(path, syls);
-            // if there's nothing, pop it.
-            if (!newPaths.back().triePositions().size()) {
-                newPaths.pop_back();
+            auto positions = traverseAlongPathOneStepBySyllables(path, syls);
+            // if there's nothing, skip it.
+            if (positions.size()) {
+                newPaths.emplace_back(
+                    path.trie(), path.size() + 1,
+                    matchedPathsMap.addStep(path.step_, &currentNode),
+                    path.pathSize_ + 1, path.start_, path.flags_);
+                newPaths.back().triePositions() = std::move(positions);
             }
         }
     }
@@ -532,7 +836,7 @@ void PinyinDictionary::matchPrefixImpl(
     void *helper) const {
     FCITX_D();
 
-    NodeToMatchedPinyinPathsMap localMatchedPaths;
+    MatchedPinyinPathStore localMatchedPaths;
     PinyinMatchContext context =
         helper ? PinyinMatchContext{graph, callback, ignore,
                                     static_cast<PinyinMatchState *>(helper)}
@@ -602,11 +906,12 @@ void PinyinDictionary::matchWords(const char *data, size_t size,
                 }
             } else {
                 bool changed = false;
-                for (char test = PinyinEncoder::firstFinal;
-                     test <= PinyinEncoder::lastFinal; test++) {
-                    decltype(extraNodes)::value_type p = *iter;
-                    auto result = p.first->traverse(&test, 1, p.second);
-                    if (!PinyinTrie::isNoPath(result)) {
+                auto mask = finalsOnTrie(*iter->first, iter->second);
+                for (char test = PinyinEncoder::firstFinal; mask;
+                     test++, mask >>= 1) {
+                    if (mask & 1) {
+                        decltype(extraNodes)::value_type p = *iter;
+                        p.first->traverse(&test, 1, p.second);
                         extraNodes.push_back(p);
                         changed = true;
                     }
@@ -623,16 +928,17 @@ void PinyinDictionary::matchWords(const char *data, size_t size,
         nodes.splice(nodes.end(), std::move(extraNodes));
     }
 
+    std::string encodedPinyin;
+    std::string hanzi;
     for (auto &node : nodes) {
+        // The position is after the separator.
+        node.first->suffix(encodedPinyin, size + 1, node.second);
+        encodedPinyin.pop_back();
         node.first->foreach(
-            [&node, &callback, size](PinyinTrie::value_type value, size_t len,
-                                     uint64_t pos) {
-                std::string s;
-                node.first->suffix(s, len + size + 1, pos);
-
-                auto view = std::string_view(s);
-                return callback(s.substr(0, size), view.substr(size + 1),
-                                value);
+            [&node, &callback, &encodedPinyin,
+             &hanzi](PinyinTrie::value_type value, size_t len, uint64_t pos) {
+                node.first->suffix(hanzi, len, pos);
+                return callback(encodedPinyin, hanzi, value);
             },
             node.second);
     }
@@ -644,6 +950,13 @@ PinyinDictionary::PinyinDictionary()
         FCITX_D();
         d->flags_.resize(size);
     });
+    d->changedConn_ =
+        connect<TrieDictionary::dictionaryChanged>([this](size_t idx) {
+            FCITX_D();
+            if (!d->updatingWord_) {
+                d->sortedIndex_.erase(trie(idx));
+            }
+        });
     d->flags_.resize(dictSize());
 }
 
@@ -759,20 +1072,31 @@ void PinyinDictionary::saveText(size_t idx, std::ostream &out) {
 
 void PinyinDictionary::addWord(size_t idx, std::string_view fullPinyin,
                                std::string_view hanzi, float cost) {
+    FCITX_D();
     auto result = PinyinEncoder::encodeFullPinyin(fullPinyin);
     result.push_back(pinyinHanziSep);
     result.insert(result.end(), hanzi.begin(), hanzi.end());
-    TrieDictionary::addWord(idx, std::string_view(result.data(), result.size()),
-                            cost);
+    std::string_view key(result.data(), result.size());
+    d->updatingWord_ = true;
+    TrieDictionary::addWord(idx, key, cost);
+    d->updatingWord_ = false;
+    d->updateSortedIndex(trie(idx), key, cost);
 }
 
 bool PinyinDictionary::removeWord(size_t idx, std::string_view fullPinyin,
                                   std::string_view hanzi) {
+    FCITX_D();
     auto result = PinyinEncoder::encodeFullPinyin(fullPinyin);
     result.push_back(pinyinHanziSep);
     result.insert(result.end(), hanzi.begin(), hanzi.end());
-    return TrieDictionary::removeWord(
-        idx, std::string_view(result.data(), result.size()));
+    std::string_view key(result.data(), result.size());
+    d->updatingWord_ = true;
+    bool removed = TrieDictionary::removeWord(idx, key);
+    d->updatingWord_ = false;
+    if (removed) {
+        d->updateSortedIndex(trie(idx), key, std::nullopt);
+    }
+    return removed;
 }
 
 void PinyinDictionary::setFlags(size_t idx, PinyinDictFlags flags) {
@@ -783,4 +1107,17 @@ void PinyinDictionary::setFlags(size_t idx, PinyinDictFlags flags) {
     d->flags_.resize(dictSize());
     d->flags_[idx] = flags;
 }
+
+void PinyinDictionary::setLanguageModel(const LanguageModelBase *model) {
+    FCITX_D();
+    if (d->model_ != model) {
+        d->model_ = model;
+        d->sortedIndex_.clear();
+    }
+}
+
+const LanguageModelBase *PinyinDictionary::languageModel() const {
+    FCITX_D();
+    return d->model_;
+}
 } // namespace libime
@@ -9,6 +9,7 @@
 #include "libimepinyin_export.h"
 #include <fcitx-utils/connectableobject.h>
 #include <fcitx-utils/macros.h>
+#include <libime/core/languagemodel.h>
 #include <libime/core/triedictionary.h>
 #include <libime/pinyin/pinyinencoder.h>
 #include <memory>
@@ -53,6 +54,15 @@ public:
 
     void setFlags(size_t idx, PinyinDictFlags flags);
 
+    /// \brief Set the language model used to resolve matched words.
+    ///
+    /// When a model is set, the word index of a matched entry is looked up
+    /// once and remembered by its position in the trie, so the decoder does
+    /// not need to hash the word again. The model must be the one used by the
+    /// decoder of this dictionary.
+    void setLanguageModel(const LanguageModelBase *model);
+    const LanguageModelBase *languageModel() const;
+
     using dictionaryChanged = TrieDictionary::dictionaryChanged;
 
 protected:
@@ -9,12 +9,15 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/bimap.hpp>
 #include <boost/bimap/unordered_set_of.hpp>
+#include <array>
 #include <fcitx-utils/charutils.h>
-#include <queue>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string_view>
 #include <tuple>
 #include <unordered_map>
+#include <vector>
 
 namespace libime {
 
@@ -76,84 +79,181 @@ static const auto finalMap = makeBimap<PinyinFinal, std::string>({
 
 static const int maxPinyinLength = 6;
 
-template <typename Iter>
-std::pair<std::string_view, bool> longestMatch(Iter iter, Iter end,
-                                               PinyinFuzzyFlags flags) {
-    if (std::distance(iter, end) > maxPinyinLength) {
-        end = iter + maxPinyinLength;
+// Result of PinyinMatcher::longestMatch.
+struct PinyinMatch {
+    // Size of the match, which is at least 1 for a non empty input.
+    size_t size_ = 0;
+    bool complete_ = false;
+    // The nodes of the match, and of the match without its last letter.
+    uint16_t node_ = 0;
+    uint16_t shorterNode_ = 0;
+};
+
+// A trie over the letters of every pinyin and initial, along with the inner
+// segments. It is built once, so matching is a single walk over the input
+// instead of a map lookup for each of its prefixes.
+class PinyinMatcher {
+public:
+    struct Node {
+        // 0 is no transition, since the root is never a target.
+        std::array<uint16_t, 26> next_ = {};
+        // Range in flags_ of the fuzzy flags needed by pinyin of this node.
+        uint16_t flagsBegin_ = 0;
+        uint16_t flagsEnd_ = 0;
+        bool initial_ = false;
+        // Size of the first part of the inner segment, or 0.
+        uint8_t innerSplit_ = 0;
+
+        bool isPinyin() const { return flagsBegin_ != flagsEnd_; }
+    };
+
+    static const PinyinMatcher &instance() {
+        static const PinyinMatcher matcher;
+        return matcher;
     }
-    auto range = std::string_view(&*iter, std::distance(iter, end));
-    auto &map = getPinyinMap();
-    for (; range.size(); range.remove_suffix(1)) {
-        auto iterPair = map.equal_range(range);
-        if (iterPair.first != iterPair.second) {
-            for (auto &item :
-                 boost::make_iterator_range(iterPair.first, iterPair.second)) {
-                if (flags.test(item.flags())) {
-                    // do not consider m/n/r as complete pinyin
-                    return std::make_pair(
-                        range, (range != "m" && range != "n" && range != "r"));
+
+    const Node &node(uint16_t idx) const { return nodes_[idx]; }
+    size_t size() const { return nodes_.size(); }
+
+    // The node of the lower case of input, or -1 if there is none.
+    int find(std::string_view input) const {
+        uint16_t current = 0;
+        for (auto c : input) {
+            c = fcitx::charutils::tolower(c);
+            if (c < 'a' || c > 'z' || !nodes_[current].next_[c - 'a']) {
+                return -1;
+            }
+            current = nodes_[current].next_[c - 'a'];
+        }
+        return current;
+    }
+
+    // The longest prefix of input that is a pinyin usable with flags, or an
+    // initial of at most 2 letters. m/n/r are not considered complete pinyin.
+    PinyinMatch longestMatch(std::string_view input,
+                             PinyinFuzzyFlags flags) const {
+        PinyinMatch match;
+        uint16_t current = 0;
+        const auto size =
+            std::min(input.size(), static_cast<size_t>(maxPinyinLength));
+        for (size_t i = 0; i < size; i++) {
+            if (input[i] < 'a' || input[i] > 'z') {
+                break;
+            }
+            auto next = nodes_[current].next_[input[i] - 'a'];
+            if (!next) {
+                break;
+            }
+            if (matchFlags(nodes_[next], flags)) {
+                match = {i + 1, i != 0 || (input[i] != 'm' && input[i] != 'n' &&
+                                           input[i] != 'r'),
+                         next, current};
+            } else if (i < 2 && nodes_[next].initial_) {
+                match = {i + 1, false, next, current};
+            }
+            current = next;
+        }
+        if (!match.size_ && !input.empty()) {
+            match.size_ = 1;
+        }
+        return match;
+    }
+
+private:
+    PinyinMatcher() : nodes_(1) {
+        std::vector<std::vector<PinyinFuzzyFlags>> nodeFlags(1);
+        auto insert = [this, &nodeFlags](std::string_view str) {
+            uint16_t current = 0;
+            for (auto c : str) {
+                if (!nodes_[current].next_[c - 'a']) {
+                    nodes_[current].next_[c - 'a'] = nodes_.size();
+                    nodes_.emplace_back();
+                    nodeFlags.emplace_back();
                 }
+                current = nodes_[current].next_[c - 'a'];
+            }
+            return current;
+        };
+        for (const auto &item : getPinyinMap()) {
+            auto &flags = nodeFlags[insert(item.pinyin())];
+            if (std::find(flags.begin(), flags.end(), item.flags()) ==
+                flags.end()) {
+                flags.push_back(item.flags());
             }
         }
-        if (range.size() <= 2) {
-            auto iter = initialMap.right.find(std::string{range});
-            if (iter != initialMap.right.end()) {
-                return std::make_pair(range, false);
+        for (const auto &item : initialMap.right) {
+            if (!item.first.empty()) {
+                nodes_[insert(item.first)].initial_ = true;
             }
         }
+        for (const auto &item : getInnerSegment()) {
+            nodes_[insert(item.first)].innerSplit_ = item.second.first.size();
+        }
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            nodes_[i].flagsBegin_ = flags_.size();
+            flags_.insert(flags_.end(), nodeFlags[i].begin(),
+                          nodeFlags[i].end());
+            nodes_[i].flagsEnd_ = flags_.size();
+        }
     }
 
-    if (!range.size()) {
-        range = std::string_view(&*iter, 1);
+    bool matchFlags(const Node &node, PinyinFuzzyFlags flags) const {
+        for (auto i = node.flagsBegin_; i < node.flagsEnd_; i++) {
+            if (flags.test(flags_[i])) {
+                return true;
+            }
+        }
+        return false;
     }
 
-    return std::make_pair(range, false);
-}
+    std::vector<Node> nodes_;
+    std::vector<PinyinFuzzyFlags> flags_;
+};
 
 std::string PinyinSyllable::toString() const {
     return PinyinEncoder::initialToString(initial_) +
            PinyinEncoder::finalToString(final_);
 }
 
-SegmentGraph PinyinEncoder::parseUserPinyin(std::string userPinyin,
-                                            PinyinFuzzyFlags flags) {
-    SegmentGraph result{std::move(userPinyin)};
-    auto pinyin = result.data();
-    std::transform(pinyin.begin(), pinyin.end(), pinyin.begin(),
-                   fcitx::charutils::tolower);
-    auto end = pinyin.end();
-    std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t>> q;
-    q.push(0);
-    while (q.size()) {
-        size_t top;
-        do {
-            top = q.top();
-            q.pop();
-        } while (q.size() && q.top() == top);
-        if (top >= pinyin.size()) {
+// Parse the lower case pinyin from the positions marked in reachable, which
+// has a slot for each position including the end, and call addNext with
+// each segment.
+template <typename AddNext>
+void parsePinyinSegments(std::string_view pinyin, std::vector<bool> &reachable,
+                         PinyinFuzzyFlags flags, AddNext addNext) {
+    const auto &matcher = PinyinMatcher::instance();
+    // Segments only go forward, so positions are parsed in a single scan.
+    // The match at a position is kept, since it may be looked ahead before
+    // the position is parsed.
+    std::vector<PinyinMatch> matches(pinyin.size());
+    auto longestMatch = [&matches, &matcher, &pinyin,
+                         flags](size_t pos) -> const PinyinMatch & {
+        auto &match = matches[pos];
+        if (!match.size_) {
+            match = matcher.longestMatch(pinyin.substr(pos), flags);
+        }
+        return match;
+    };
+    for (size_t top = 0; top < pinyin.size(); top++) {
+        if (!reachable[top]) {
             continue;
         }
-        auto iter = std::next(pinyin.begin(), top);
-        if (*iter == '\'') {
-            while (*iter == '\'' && iter != pinyin.end()) {
-                iter++;
-            }
-            auto next = std::distance(pinyin.begin(), iter);
-            result.addNext(top, next);
-            if (static_cast<size_t>(next) < pinyin.size()) {
-                q.push(next);
+        if (pinyin[top] == '\'') {
+            auto next = top;
+            while (next < pinyin.size() && pinyin[next] == '\'') {
+                next++;
             }
+            addNext(top, next);
+            reachable[next] = true;
             continue;
         }
-        std::string_view str;
-        bool isCompletePinyin;
-        std::tie(str, isCompletePinyin) = longestMatch(iter, end, flags);
+        const auto &match = longestMatch(top);
+        const auto size = match.size_;
 
         // it's not complete a pinyin, no need to try
-        if (!isCompletePinyin) {
-            result.addNext(top, top + str.size());
-            q.push(top + str.size());
+        if (!match.complete_) {
+            addNext(top, top + size);
+            reachable[top + size] = true;
         } else {
             // check fuzzy seg
             // pinyin may end with aegimnoruv
@@ -163,55 +263,164 @@ SegmentGraph PinyinEncoder::parseUserPinyin(std::string userPinyin,
             // also, make sure current pinyin does not end with a separator,
             // other wise, jin'an may be parsed into ji'n because, nextMatch is
             // starts with "'".
-            auto &map = getPinyinMap();
-            std::array<size_t, 2> nextSize;
+            const auto last = pinyin[top + size - 1];
+            std::array<std::pair<size_t, uint16_t>, 2> nextSize;
             size_t nNextSize = 0;
-            if (str.size() > 1 && top + str.size() < pinyin.size() &&
-                pinyin[top + str.size()] != '\'' &&
-                (str.back() == 'a' || str.back() == 'e' || str.back() == 'g' ||
-                 str.back() == 'n' || str.back() == 'o' || str.back() == 'r') &&
-                map.find(str.substr(0, str.size() - 1)) != map.end()) {
+            if (size > 1 && top + size < pinyin.size() &&
+                pinyin[top + size] != '\'' &&
+                (last == 'a' || last == 'e' || last == 'g' || last == 'n' ||
+                 last == 'o' || last == 'r') &&
+                matcher.node(match.shorterNode_).isPinyin()) {
                 // str[0:-1] is also a full pinyin, check next pinyin
-                auto nextMatch = longestMatch(iter + str.size(), end, flags);
-                auto nextMatchAlt =
-                    longestMatch(iter + str.size() - 1, end, flags);
-                auto matchSize = str.size() + nextMatch.first.size();
-                auto matchSizeAlt = str.size() - 1 + nextMatchAlt.first.size();
-                if (std::make_pair(matchSize, nextMatch.second) >=
-                    std::make_pair(matchSizeAlt, nextMatchAlt.second)) {
-                    result.addNext(top, top + str.size());
-                    q.push(top + str.size());
-                    nextSize[nNextSize++] = str.size();
+                const auto &nextMatch = longestMatch(top + size);
+                const auto &nextMatchAlt = longestMatch(top + size - 1);
+                auto matchSize = size + nextMatch.size_;
+                auto matchSizeAlt = size - 1 + nextMatchAlt.size_;
+                if (std::make_pair(matchSize, nextMatch.complete_) >=
+                    std::make_pair(matchSizeAlt, nextMatchAlt.complete_)) {
+                    addNext(top, top + size);
+                    reachable[top + size] = true;
+                    nextSize[nNextSize++] = {size, match.node_};
                 }
-                if (std::make_pair(matchSize, nextMatch.second) <=
-                    std::make_pair(matchSizeAlt, nextMatchAlt.second)) {
-                    result.addNext(top, top + str.size() - 1);
-                    q.push(top + str.size() - 1);
-                    nextSize[nNextSize++] = str.size() - 1;
+                if (std::make_pair(matchSize, nextMatch.complete_) <=
+                    std::make_pair(matchSizeAlt, nextMatchAlt.complete_)) {
+                    addNext(top, top + size - 1);
+                    reachable[top + size - 1] = true;
+                    nextSize[nNextSize++] = {size - 1, match.shorterNode_};
                 }
             } else {
-                result.addNext(top, top + str.size());
-                q.push(top + str.size());
-                nextSize[nNextSize++] = str.size();
+                addNext(top, top + size);
+                reachable[top + size] = true;
+                nextSize[nNextSize++] = {size, match.node_};
             }
 
             for (size_t i = 0; i < nNextSize; i++) {
-                if (nextSize[i] >= 4 && flags.test(PinyinFuzzyFlag::Inner)) {
-                    auto &innerSegments = getInnerSegment();
-                    auto iter = innerSegments.find(
-                        std::string{str.substr(0, nextSize[i])});
-                    if (iter != innerSegments.end()) {
-                        result.addNext(top, top + iter->second.first.size());
-                        result.addNext(top + iter->second.first.size(),
-                                       top + nextSize[i]);
+                if (nextSize[i].first >= 4 &&
+                    flags.test(PinyinFuzzyFlag::Inner)) {
+                    auto split = matcher.node(nextSize[i].second).innerSplit_;
+                    if (split) {
+                        addNext(top, top + split);
+                        addNext(top + split, top + nextSize[i].first);
                     }
                 }
             }
         }
     }
+}
+
+SegmentGraph PinyinEncoder::parseUserPinyin(std::string userPinyin,
+                                            PinyinFuzzyFlags flags) {
+    SegmentGraph result{std::move(userPinyin)};
+    auto pinyin = result.data();
+    std::transform(pinyin.begin(), pinyin.end(), pinyin.begin(),
+                   fcitx::charutils::tolower);
+    std::vector<bool> reachable(pinyin.size() + 1);
+    reachable[0] = true;
+    parsePinyinSegments(pinyin, reachable, flags,
+                        [&result](size_t from, size_t to) {
+                            result.addNext(from, to);
+                        });
     return result;
 }
 
+std::unordered_set<const SegmentGraphNode *>
+PinyinEncoder::updateUserPinyin(SegmentGraph &graph, std::string userPinyin,
+                                PinyinFuzzyFlags flags) {
+    const auto &old = graph.data();
+    const size_t edit =
+        std::mismatch(old.begin(), old.end(), userPinyin.begin(),
+                      userPinyin.end())
+            .first -
+        old.begin();
+    if (edit == old.size() && edit == userPinyin.size()) {
+        return {};
+    }
+
+    // Segments from a position depend on at most two matches after it, or
+    // on the whole run of separators.
+    size_t unchanged = edit > 2 * maxPinyinLength ? edit - 2 * maxPinyinLength
+                                                  : 0;
+    auto separators = edit;
+    while (separators > 0 && userPinyin[separators - 1] == '\'') {
+        separators--;
+    }
+    unchanged = std::min(unchanged, separators);
+    // Parse again from the last node before it that every path goes through,
+    // since nothing parsed before such a node reaches over it. Only segments
+    // of separators are longer than maxPinyinLength.
+    auto isCut = [&graph, &userPinyin](size_t pos) {
+        if (graph.nodes(pos).empty() ||
+            (userPinyin[pos - 1] == '\'' && userPinyin[pos] == '\'')) {
+            return false;
+        }
+        for (auto i = pos > maxPinyinLength ? pos - maxPinyinLength : 0;
+             i < pos; i++) {
+            for (const auto &node : graph.nodes(i)) {
+                for (const auto &next : node.nexts()) {
+                    if (next.index() > pos) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    };
+    auto from = unchanged;
+    while (from > 0 && !isCut(from)) {
+        from--;
+    }
+
+    std::string pinyin = userPinyin.substr(from);
+    std::transform(pinyin.begin(), pinyin.end(), pinyin.begin(),
+                   fcitx::charutils::tolower);
+    std::vector<bool> reachable(pinyin.size() + 1);
+    reachable[0] = true;
+    std::vector<std::vector<size_t>> nexts(userPinyin.size() + 1 - unchanged);
+    parsePinyinSegments(pinyin, reachable, flags,
+                        [&nexts, from, unchanged](size_t segFrom, size_t to) {
+                            if (segFrom + from < unchanged) {
+                                return;
+                            }
+                            // Adding an edge again doesn't change the graph.
+                            auto &next = nexts[segFrom + from - unchanged];
+                            if (std::find(next.begin(), next.end(),
+                                          to + from) == next.end()) {
+                                next.push_back(to + from);
+                            }
+                        });
+
+    // Keep the nodes until the first one with different segments, like
+    // SegmentGraph::merge. Segments over the edit have a different string,
+    // and the end of either graph differs at the edit at the latest.
+    auto since = unchanged;
+    for (; since < edit; since++) {
+        const auto &next = nexts[since - unchanged];
+        auto nodes = graph.nodes(since);
+        if (nodes.empty()) {
+            if (next.empty()) {
+                continue;
+            }
+            break;
+        }
+        const auto &node = nodes.front();
+        if (node.nextSize() != next.size() ||
+            !std::equal(next.begin(), next.end(), node.nexts().begin(),
+                        [edit](size_t to, const SegmentGraphNode &oldNext) {
+                            return to <= edit && to == oldNext.index();
+                        })) {
+            break;
+        }
+    }
+
+    auto discarded = graph.resetFrom(since, std::move(userPinyin));
+    for (auto i = since; i < nexts.size() + unchanged; i++) {
+        for (auto to : nexts[i - unchanged]) {
+            graph.addNext(i, to);
+        }
+    }
+    return discarded;
+}
+
 SegmentGraph PinyinEncoder::parseUserShuangpin(std::string userPinyin,
                                                const ShuangpinProfile &sp,
                                                PinyinFuzzyFlags flags) {
@@ -586,6 +795,64 @@ PinyinEncoder::stringToSyllables(std::string_view pinyinView,
     return result;
 }
 
+// stringToSyllables of every string in PinyinMatcher for one fuzzy flags.
+// Other strings have no syllables.
+class PinyinSyllableTable {
+public:
+    PinyinSyllableTable(PinyinFuzzyFlags flags)
+        : flags_(flags), syllables_(PinyinMatcher::instance().size()),
+          invalid_{{PinyinInitial::Invalid, {{PinyinFinal::Invalid, false}}}} {
+        const auto &matcher = PinyinMatcher::instance();
+        std::string pinyin;
+        auto fill = [this, &matcher, &pinyin](uint16_t idx,
+                                              auto &self) -> void {
+            syllables_[idx] = PinyinEncoder::stringToSyllables(pinyin, flags_);
+            for (char c = 'a'; c <= 'z'; c++) {
+                if (auto next = matcher.node(idx).next_[c - 'a']) {
+                    pinyin.push_back(c);
+                    self(next, self);
+                    pinyin.pop_back();
+                }
+            }
+        };
+        fill(0, fill);
+    }
+
+    static const PinyinSyllableTable &get(PinyinFuzzyFlags flags) {
+        thread_local const PinyinSyllableTable *last = nullptr;
+        if (last && last->flags_ == flags) {
+            return *last;
+        }
+        static std::mutex mutex;
+        static std::unordered_map<uint32_t,
+                                  std::unique_ptr<const PinyinSyllableTable>>
+            tables;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &table = tables[flags.toInteger()];
+        if (!table) {
+            table = std::make_unique<PinyinSyllableTable>(flags);
+        }
+        last = table.get();
+        return *table;
+    }
+
+    const MatchedPinyinSyllables &syllables(std::string_view pinyin) const {
+        auto idx = PinyinMatcher::instance().find(pinyin);
+        return idx < 0 ? invalid_ : syllables_[idx];
+    }
+
+private:
+    PinyinFuzzyFlags flags_;
+    std::vector<MatchedPinyinSyllables> syllables_;
+    MatchedPinyinSyllables invalid_;
+};
+
+const MatchedPinyinSyllables &
+PinyinEncoder::cachedStringToSyllables(std::string_view pinyin,
+                                       PinyinFuzzyFlags flags) {
+    return PinyinSyllableTable::get(flags).syllables(pinyin);
+}
+
 MatchedPinyinSyllables
 PinyinEncoder::shuangpinToSyllables(std::string_view pinyinView,
                                     const ShuangpinProfile &sp,
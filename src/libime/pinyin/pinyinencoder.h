@@ -15,6 +15,7 @@
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace libime {
@@ -184,6 +185,12 @@ class LIBIMEPINYIN_EXPORT PinyinEncoder {
 public:
     static SegmentGraph parseUserPinyin(std::string pinyin,
                                         PinyinFuzzyFlags flags);
+    // Update graph, parsed from another pinyin with the same flags, to be
+    // parseUserPinyin(pinyin, flags). Only segments after the first changed
+    // character are parsed again. Returns the nodes to discard from Lattice.
+    static std::unordered_set<const SegmentGraphNode *>
+    updateUserPinyin(SegmentGraph &graph, std::string pinyin,
+                     PinyinFuzzyFlags flags);
     static SegmentGraph parseUserShuangpin(std::string pinyin,
                                            const ShuangpinProfile &sp,
                                            PinyinFuzzyFlags flags);
@@ -227,6 +234,10 @@ public:
 
     static MatchedPinyinSyllables stringToSyllables(std::string_view pinyin,
                                                     PinyinFuzzyFlags flags);
+    // Same as stringToSyllables, from a table built once for each flags.
+    // The result is shared and stays valid until the program exits.
+    static const MatchedPinyinSyllables &
+    cachedStringToSyllables(std::string_view pinyin, PinyinFuzzyFlags flags);
     static MatchedPinyinSyllables
     shuangpinToSyllables(std::string_view pinyin, const ShuangpinProfile &sp,
                          PinyinFuzzyFlags flags);
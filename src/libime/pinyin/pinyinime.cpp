@@ -6,38 +6,33 @@
 #include "pinyinime.h"
 #include "libime/core/userlanguagemodel.h"
 #include "pinyindecoder.h"
+#include "pinyindictionary.h"
+#include "pinyinime_p.h"
 
 namespace libime {
 
-class PinyinIMEPrivate : fcitx::QPtrHolder<PinyinIME> {
-public:
-    PinyinIMEPrivate(PinyinIME *q, std::unique_ptr<PinyinDictionary> dict,
-                     std::unique_ptr<UserLanguageModel> model)
-        : fcitx::QPtrHolder<PinyinIME>(q), dict_(std::move(dict)),
-          model_(std::move(model)),
-          decoder_(std::make_unique<PinyinDecoder>(dict_.get(), model_.get())) {
-    }
-
-    FCITX_DEFINE_SIGNAL_PRIVATE(PinyinIME, optionChanged);
-
-    PinyinFuzzyFlags flags_;
-    std::unique_ptr<PinyinDictionary> dict_;
-    std::unique_ptr<UserLanguageModel> model_;
-    std::unique_ptr<PinyinDecoder> decoder_;
-    std::shared_ptr<const ShuangpinProfile> spProfile_;
-    size_t nbest_ = 1;
-    size_t beamSize_ = Decoder::beamSizeDefault;
-    size_t frameSize_ = Decoder::frameSizeDefault;
-    size_t partialLongWordLimit_ = 0;
-    float maxDistance_ = std::numeric_limits<float>::max();
-    float minPath_ = -std::numeric_limits<float>::max();
-    PinyinPreeditMode preeditMode_ = PinyinPreeditMode::RawText;
-};
-
 PinyinIME::PinyinIME(std::unique_ptr<PinyinDictionary> dict,
                      std::unique_ptr<UserLanguageModel> model)
     : d_ptr(std::make_unique<PinyinIMEPrivate>(this, std::move(dict),
-                                               std::move(model))) {}
+                                               std::move(model))) {
+    FCITX_D();
+    if (d->dict_) {
+        d->dict_->setLanguageModel(d->model_.get());
+        d->dictChangedConn_ =
+            d->dict_->connect<PinyinDictionary::dictionaryChanged>(
+                [this](size_t idx) {
+                    FCITX_D();
+                    auto trie = d->dict_->trie(idx);
+                    d->pinyinMatchCache_.erase(trie);
+                    d->shuangpinMatchCache_.erase(trie);
+                });
+    }
+    d->optionChangedConn_ = connect<PinyinIME::optionChanged>([this]() {
+        FCITX_D();
+        d->pinyinMatchCache_.clear();
+        d->shuangpinMatchCache_.clear();
+    });
+}
 
 PinyinIME::~PinyinIME() {}
 
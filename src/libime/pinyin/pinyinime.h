@@ -24,6 +24,8 @@ enum class PinyinPreeditMode { RawText, Pinyin };
 
 /// \brief Provides shared data for PinyinContext.
 class LIBIMEPINYIN_EXPORT PinyinIME : public fcitx::ConnectableObject {
+    friend class PinyinMatchStatePrivate;
+
 public:
     PinyinIME(std::unique_ptr<PinyinDictionary> dict,
               std::unique_ptr<UserLanguageModel> model);
@@ -0,0 +1,50 @@
+/*
+ * SPDX-FileCopyrightText: 2017-2017 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef _FCITX_LIBIME_PINYIN_PINYINIME_P_H_
+#define _FCITX_LIBIME_PINYIN_PINYINIME_P_H_
+
+#include "libime/core/decoder.h"
+#include "libime/core/userlanguagemodel.h"
+#include "pinyindecoder.h"
+#include "pinyindictionary.h"
+#include "pinyinime.h"
+#include "pinyinmatchstate_p.h"
+
+namespace libime {
+
+class PinyinIMEPrivate : fcitx::QPtrHolder<PinyinIME> {
+public:
+    PinyinIMEPrivate(PinyinIME *q, std::unique_ptr<PinyinDictionary> dict,
+                     std::unique_ptr<UserLanguageModel> model)
+        : fcitx::QPtrHolder<PinyinIME>(q), dict_(std::move(dict)),
+          model_(std::move(model)),
+          decoder_(std::make_unique<PinyinDecoder>(dict_.get(), model_.get())) {
+    }
+
+    FCITX_DEFINE_SIGNAL_PRIVATE(PinyinIME, optionChanged);
+
+    PinyinFuzzyFlags flags_;
+    std::unique_ptr<PinyinDictionary> dict_;
+    std::unique_ptr<UserLanguageModel> model_;
+    std::unique_ptr<PinyinDecoder> decoder_;
+    std::shared_ptr<const ShuangpinProfile> spProfile_;
+    size_t nbest_ = 1;
+    size_t beamSize_ = Decoder::beamSizeDefault;
+    size_t frameSize_ = Decoder::frameSizeDefault;
+    size_t partialLongWordLimit_ = 0;
+    float maxDistance_ = std::numeric_limits<float>::max();
+    float minPath_ = -std::numeric_limits<float>::max();
+    PinyinPreeditMode preeditMode_ = PinyinPreeditMode::RawText;
+    // Match results shared by every PinyinContext, keyed by the raw input.
+    // Full pinyin and shuangpin parse the same input differently.
+    PinyinMatchCache pinyinMatchCache_;
+    PinyinMatchCache shuangpinMatchCache_;
+    fcitx::ScopedConnection dictChangedConn_;
+    fcitx::ScopedConnection optionChangedConn_;
+};
+} // namespace libime
+
+#endif // _FCITX_LIBIME_PINYIN_PINYINIME_P_H_
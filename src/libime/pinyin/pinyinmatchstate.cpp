@@ -6,6 +6,7 @@
 
 #include "pinyincontext.h"
 #include "pinyinime.h"
+#include "pinyinime_p.h"
 #include "pinyinmatchstate_p.h"
 
 namespace libime {
@@ -17,27 +18,64 @@ PinyinMatchState::~PinyinMatchState() {}
 void PinyinMatchState::clear() {
     FCITX_D();
     d->matchedPaths_.clear();
-    d->nodeCacheMap_.clear();
-    d->matchCacheMap_.clear();
 }
 
-void PinyinMatchState::discardNode(
+PinyinMatchCache *PinyinMatchStatePrivate::matchCache() const {
+    auto *ime = context_->ime()->d_func();
+    return context_->useShuangpin() ? &ime->shuangpinMatchCache_
+                                    : &ime->pinyinMatchCache_;
+}
+
+void MatchedPinyinPathStore::discardNode(
     const std::unordered_set<const SegmentGraphNode *> &nodes) {
-    FCITX_D();
     for (auto node : nodes) {
-        d->matchedPaths_.erase(node);
+        paths_.erase(node);
     }
-    for (auto &p : d->matchedPaths_) {
+    for (auto &p : paths_) {
         auto &l = p.second;
         auto iter = l.begin();
         while (iter != l.end()) {
-            if (nodes.count(iter->path_.front())) {
+            if (nodes.count(iter->start_)) {
                 iter = l.erase(iter);
             } else {
                 iter++;
             }
         }
     }
+
+    // Drop the steps no longer in any path. A step is always after the one
+    // before it, so the new index of the step before is known.
+    std::vector<uint32_t> index(steps_.size(), noStep);
+    for (auto &p : paths_) {
+        for (auto &path : p.second) {
+            for (auto step = path.step_;
+                 step != noStep && index[step] == noStep;
+                 step = steps_[step].prev_) {
+                index[step] = 0;
+            }
+        }
+    }
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < steps_.size(); i++) {
+        if (index[i] == noStep) {
+            continue;
+        }
+        auto prev = steps_[i].prev_;
+        steps_[size] = {steps_[i].node_, prev == noStep ? noStep : index[prev]};
+        index[i] = size++;
+    }
+    steps_.resize(size);
+    for (auto &p : paths_) {
+        for (auto &path : p.second) {
+            path.step_ = index[path.step_];
+        }
+    }
+}
+
+void PinyinMatchState::discardNode(
+    const std::unordered_set<const SegmentGraphNode *> &nodes) {
+    FCITX_D();
+    d->matchedPaths_.discardNode(nodes);
 }
 
 PinyinFuzzyFlags PinyinMatchState::fuzzyFlags() const {
@@ -59,9 +97,13 @@ size_t PinyinMatchState::partialLongWordLimit() const {
     return d->context_->ime()->partialLongWordLimit();
 }
 
+size_t PinyinMatchState::frameSize() const {
+    FCITX_D();
+    return d->context_->ime()->frameSize();
+}
+
 void PinyinMatchState::discardDictionary(size_t idx) {
     FCITX_D();
-    d->matchCacheMap_.erase(d->context_->ime()->dict()->trie(idx));
-    d->nodeCacheMap_.erase(d->context_->ime()->dict()->trie(idx));
+    d->matchCache()->erase(d->context_->ime()->dict()->trie(idx));
 }
 } // namespace libime
@@ -26,7 +26,8 @@ public:
     PinyinMatchState(PinyinContext *context);
     ~PinyinMatchState();
 
-    // Invalidate everything in the state.
+    // Invalidate everything in the state. The match results shared by the
+    // PinyinIME are kept, they are invalidated by the IME itself.
     void clear();
 
     // Invalidate a set of node, usually caused by the change of user input.
@@ -39,6 +40,7 @@ public:
     PinyinFuzzyFlags fuzzyFlags() const;
     std::shared_ptr<const ShuangpinProfile> shuangpinProfile() const;
     size_t partialLongWordLimit() const;
+    size_t frameSize() const;
 
 private:
     std::unique_ptr<PinyinMatchStatePrivate> d_ptr;
@@ -11,8 +11,11 @@
 #include <libime/core/lrucache.h>
 #include <libime/pinyin/pinyindictionary.h>
 #include <libime/pinyin/pinyinmatchstate.h>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 
 namespace libime {
 
@@ -36,25 +39,28 @@ struct MatchedPinyinTrieNodes {
 // adjustment score.
 struct PinyinMatchResult {
     PinyinMatchResult(std::string_view s, float value,
-                      std::string_view encodedPinyin)
-        : word_(s, InvalidWordIndex), value_(value),
-          encodedPinyin_(encodedPinyin) {}
+                      std::string_view encodedPinyin,
+                      WordIndex idx = InvalidWordIndex)
+        : word_(s, idx), value_(value), encodedPinyin_(encodedPinyin) {}
     WordNode word_;
     float value_;
     std::string encodedPinyin_;
 };
 
 // class to store current SegmentGraphPath leads to this match and the match
-// reuslt.
+// reuslt. The path is stored as its last step in MatchedPinyinPathStore.
 struct MatchedPinyinPath {
-    MatchedPinyinPath(const PinyinTrie *trie, size_t size,
-                      SegmentGraphPath path, PinyinDictFlags flags)
+    MatchedPinyinPath(const PinyinTrie *trie, size_t size, uint32_t step,
+                      uint32_t pathSize, const SegmentGraphNode *start,
+                      PinyinDictFlags flags)
         : result_(std::make_shared<MatchedPinyinTrieNodes>(trie, size)),
-          path_(std::move(path)), flags_(flags) {}
+          step_(step), pathSize_(pathSize), start_(start), flags_(flags) {}
 
     MatchedPinyinPath(std::shared_ptr<MatchedPinyinTrieNodes> result,
-                      SegmentGraphPath path, PinyinDictFlags flags)
-        : result_(result), path_(std::move(path)), flags_(flags) {}
+                      uint32_t step, uint32_t pathSize,
+                      const SegmentGraphNode *start, PinyinDictFlags flags)
+        : result_(std::move(result)), step_(step), pathSize_(pathSize),
+          start_(start), flags_(flags) {}
 
     FCITX_INLINE_DEFINE_DEFAULT_DTOR_COPY_AND_MOVE(MatchedPinyinPath)
 
@@ -62,42 +68,198 @@ struct MatchedPinyinPath {
     const auto &triePositions() const { return result_->triePositions_; }
     const PinyinTrie *trie() const { return result_->trie_; }
 
-    // Size of syllables. not necessarily equal to size of path_, because there
+    // Size of syllables. not necessarily equal to size of path, because there
     // may be separators.
     auto size() const { return result_->size_; }
 
     std::shared_ptr<MatchedPinyinTrieNodes> result_;
-    SegmentGraphPath path_;
+    // Last step of the path, and the number of nodes in it.
+    uint32_t step_;
+    uint32_t pathSize_;
+    const SegmentGraphNode *start_;
     PinyinDictFlags flags_;
 };
 
 // A list of all search paths
 typedef std::vector<MatchedPinyinPath> MatchedPinyinPaths;
 
-// Map from SegmentGraphNode to Search Paths.
-typedef std::unordered_map<const SegmentGraphNode *, MatchedPinyinPaths>
-    NodeToMatchedPinyinPathsMap;
+// A node in a search path, linked to the node before it.
+struct MatchedPinyinPathStep {
+    const SegmentGraphNode *node_;
+    uint32_t prev_;
+};
+
+// Search paths of each SegmentGraphNode. Paths share the steps before their
+// last one, so extending a path adds a single step instead of copying it.
+class MatchedPinyinPathStore {
+public:
+    static constexpr uint32_t noStep = std::numeric_limits<uint32_t>::max();
+
+    MatchedPinyinPaths &operator[](const SegmentGraphNode *node) {
+        return paths_[node];
+    }
+    bool count(const SegmentGraphNode *node) const {
+        return paths_.count(node);
+    }
+
+    // Add node after prev, which may be noStep to start a path.
+    uint32_t addStep(uint32_t prev, const SegmentGraphNode *node) {
+        assert(steps_.size() < noStep);
+        steps_.push_back({node, prev});
+        return steps_.size() - 1;
+    }
+
+    // Copy the nodes of path into nodes.
+    void path(const MatchedPinyinPath &path, SegmentGraphPath &nodes) const {
+        nodes.resize(path.pathSize_);
+        auto step = path.step_;
+        for (auto iter = nodes.rbegin(), end = nodes.rend(); iter != end;
+             ++iter) {
+            *iter = steps_[step].node_;
+            step = steps_[step].prev_;
+        }
+    }
+
+    void clear() {
+        paths_.clear();
+        steps_.clear();
+    }
+
+    // Remove the paths of nodes, and those that start at nodes.
+    void discardNode(const std::unordered_set<const SegmentGraphNode *> &nodes);
+
+private:
+    std::unordered_map<const SegmentGraphNode *, MatchedPinyinPaths> paths_;
+    std::vector<MatchedPinyinPathStep> steps_;
+};
+
+// A size bounded cache for each PinyinTrie, from a pinyin string to a shared
+// value. It is locked, so the values are handed out as shared_ptr and stay
+// valid after being evicted.
+template <typename V>
+class PinyinTrieSharedCache {
+public:
+    PinyinTrieSharedCache(size_t size) : size_(size) {}
+
+    template <typename CompatibleKey, typename CompatibleHash,
+              typename CompatiblePredicate>
+    std::shared_ptr<V> find(const PinyinTrie *trie, const CompatibleKey &key,
+                            const CompatibleHash &hash,
+                            const CompatiblePredicate &pred) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = caches_.find(trie);
+        if (iter == caches_.end()) {
+            return nullptr;
+        }
+        auto *result = iter->second.find(key, hash, pred);
+        return result ? *result : nullptr;
+    }
 
-// A cache for all PinyinTries. From a pinyin string to its matched
-// PinyinTrieNode
-typedef std::unordered_map<
-    const PinyinTrie *,
-    LRUCache<std::string, std::shared_ptr<MatchedPinyinTrieNodes>>>
-    PinyinTrieNodeCache;
+    std::shared_ptr<V> find(const PinyinTrie *trie, const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = caches_.find(trie);
+        if (iter == caches_.end()) {
+            return nullptr;
+        }
+        auto *result = iter->second.find(key);
+        return result ? *result : nullptr;
+    }
 
-// A cache for PinyinMatchResult.
-typedef std::unordered_map<
-    const PinyinTrie *, LRUCache<std::string, std::vector<PinyinMatchResult>>>
-    PinyinMatchResultCache;
+    void insert(const PinyinTrie *trie, const std::string &key,
+                std::shared_ptr<V> value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = caches_.find(trie);
+        if (iter == caches_.end()) {
+            iter = caches_.emplace(trie, size_).first;
+        }
+        if (auto *old = iter->second.find(key)) {
+            *old = std::move(value);
+        } else {
+            iter->second.insert(key, std::move(value));
+        }
+    }
+
+    // Replace the value of key, if there is one, with update(value). The key
+    // is removed if update returns nullptr.
+    template <typename T>
+    void update(const PinyinTrie *trie, const std::string &key,
+                const T &update) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = caches_.find(trie);
+        if (iter == caches_.end()) {
+            return;
+        }
+        auto *value = iter->second.find(key);
+        if (!value) {
+            return;
+        }
+        if (auto updated = update(*value)) {
+            *value = std::move(updated);
+        } else {
+            iter->second.erase(key);
+        }
+    }
+
+    void erase(const PinyinTrie *trie) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        caches_.erase(trie);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        caches_.clear();
+    }
+
+private:
+    std::mutex mutex_;
+    size_t size_;
+    std::unordered_map<const PinyinTrie *,
+                       LRUCache<std::string, std::shared_ptr<V>>>
+        caches_;
+};
+
+// Matching results of a PinyinIME, shared by all of its contexts. From a
+// pinyin string to its matched PinyinTrieNode, and to its PinyinMatchResult.
+struct PinyinMatchCache {
+    static constexpr size_t nodeCacheSize = 4096;
+    static constexpr size_t resultCacheSize = 1024;
+
+    void erase(const PinyinTrie *trie) {
+        nodes_.erase(trie);
+        results_.erase(trie);
+        longWordResults_.erase(trie);
+    }
+
+    void clear() {
+        nodes_.clear();
+        results_.clear();
+        longWordResults_.clear();
+    }
+
+    // The pinyin string skips separators, but they count in whether a path
+    // is long enough to match long words.
+    auto &results(bool matchLongWord) {
+        return matchLongWord ? longWordResults_ : results_;
+    }
+
+    PinyinTrieSharedCache<MatchedPinyinTrieNodes> nodes_{nodeCacheSize};
+    // Words are stored with their index resolved by the dictionary, so the
+    // match callback has nothing left to update in them.
+    PinyinTrieSharedCache<std::vector<PinyinMatchResult>> results_{
+        resultCacheSize};
+    PinyinTrieSharedCache<std::vector<PinyinMatchResult>> longWordResults_{
+        resultCacheSize};
+};
 
 class PinyinMatchStatePrivate {
 public:
     PinyinMatchStatePrivate(PinyinContext *context) : context_(context) {}
 
+    // The cache of the IME, for the kind of pinyin the context uses.
+    PinyinMatchCache *matchCache() const;
+
     PinyinContext *context_;
-    NodeToMatchedPinyinPathsMap matchedPaths_;
-    PinyinTrieNodeCache nodeCacheMap_;
-    PinyinMatchResultCache matchCacheMap_;
+    MatchedPinyinPathStore matchedPaths_;
 };
 } // namespace libime
 
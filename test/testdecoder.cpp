@@ -93,5 +93,35 @@ int main() {
     testTime(dict, decoder, "sdfsdfsdfsdfsdfsdfsdf", PinyinFuzzyFlag::None, 2);
     testTime(dict, decoder, "ceshiyixiayebuhuichucuo", PinyinFuzzyFlag::None,
              2);
+
+    {
+        auto decodeString = [&decoder](const char *pinyin) {
+            auto graph =
+                PinyinEncoder::parseUserPinyin(pinyin, PinyinFuzzyFlag::Inner);
+            Lattice lattice;
+            decoder.decode(lattice, graph, 3, decoder.model()->nullState());
+            std::vector<std::string> result;
+            for (size_t i = 0, e = lattice.sentenceSize(); i < e; i++) {
+                result.push_back(lattice.sentence(i).toString());
+            }
+            return result;
+        };
+        auto expect = decodeString("tashiyigehaoren");
+        dict.setLanguageModel(&model);
+        FCITX_ASSERT(decodeString("tashiyigehaoren") == expect);
+        FCITX_ASSERT(decodeString("tashiyigehaoren") == expect);
+        dict.setLanguageModel(nullptr);
+        model.setScoreCacheSize(4096);
+        FCITX_ASSERT(model.scoreCacheSize() == 4096);
+        FCITX_ASSERT(decodeString("tashiyigehaoren") == expect);
+        auto misses = model.scoreCacheMisses();
+        FCITX_ASSERT(decodeString("tashiyigehaoren") == expect);
+        std::cout << "Score cache hits: " << model.scoreCacheHits()
+                  << " misses: " << model.scoreCacheMisses() << std::endl;
+        FCITX_ASSERT(model.scoreCacheHits() > 0);
+        FCITX_ASSERT(model.scoreCacheMisses() - misses <
+                     model.scoreCacheHits());
+        model.setScoreCacheSize(0);
+    }
     return 0;
 }
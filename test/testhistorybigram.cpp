@@ -5,9 +5,11 @@
  */
 
 #include "libime/core/historybigram.h"
+#include "libime/core/utils.h"
 #include <boost/range/irange.hpp>
 #include <fcitx-utils/log.h>
 #include <sstream>
+#include <thread>
 
 void testBasic() {
     using namespace libime;
@@ -173,10 +175,449 @@ void testSaveAndLoad() {
     FCITX_ASSERT(dump1.str() == dump2.str());
 }
 
+void testScoreCache() {
+    using namespace libime;
+    HistoryBigram history;
+    auto unknown = history.score("", "你好");
+    history.add({"你好"});
+    auto score = history.score("", "你好");
+    FCITX_ASSERT(score > unknown);
+    history.add({"你好"});
+    FCITX_ASSERT(history.score("", "你好") > score);
+    history.forget("你好");
+    FCITX_ASSERT(history.score("", "你好") == unknown);
+    history.add({"你好"});
+    FCITX_ASSERT(history.score("", "你好") > unknown);
+    history.clear();
+    FCITX_ASSERT(history.score("", "你好") == unknown);
+
+    history.add({"你", "好"});
+    auto context = history.context("你");
+    FCITX_ASSERT(history.score(context, "你", "好") == history.score("你", "好"));
+    FCITX_ASSERT(history.score(context, "你", "坏") == history.score("你", "坏"));
+    // The context is outdated after add, and should not be used.
+    history.add({"你", "坏"});
+    FCITX_ASSERT(history.score(context, "你", "坏") == history.score("你", "坏"));
+    FCITX_ASSERT(history.score(context, "你", "坏") > unknown);
+}
+
+void testForget() {
+    using namespace libime;
+    HistoryBigram history;
+    for (auto i : boost::irange(0, 1000)) {
+        history.add({"重复", std::to_string(i % 7), "重复"});
+    }
+    history.forget("3");
+    FCITX_ASSERT(history.isUnknown("3"));
+    FCITX_ASSERT(!history.isUnknown("4"));
+
+    std::stringstream ss;
+    history.save(ss);
+    HistoryBigram history2;
+    history2.load(ss);
+    for (auto i : boost::irange(0, 7)) {
+        auto word = std::to_string(i);
+        FCITX_ASSERT(history.score("重复", word) ==
+                     history2.score("重复", word));
+    }
+
+    history.forget("重复");
+    std::stringstream dump;
+    history.dump(dump);
+    FCITX_ASSERT(dump.str().empty());
+    FCITX_ASSERT(history.isUnknown("4"));
+}
+
+void testLog() {
+    using namespace libime;
+    HistoryBigram history;
+    history.add({"你", "好"});
+    std::stringstream snapshot;
+    history.save(snapshot);
+
+    std::stringstream log;
+    history.add({"你", "坏"});
+    history.saveLog(log);
+    history.forget("好");
+    history.add({"他", "好"});
+    history.saveLog(log);
+    // Nothing changed, so nothing is written.
+    history.saveLog(log);
+    FCITX_ASSERT(history.logSize() == 3);
+
+    // A block cut short is ignored.
+    std::stringstream partial;
+    history.add({"我"});
+    history.saveLog(partial);
+    log << partial.str().substr(0, partial.str().size() - 1);
+
+    HistoryBigram history2;
+    history2.load(snapshot);
+    history2.loadLog(log);
+    FCITX_ASSERT(history2.logSize() == 3);
+    FCITX_ASSERT(history2.isUnknown("我"));
+    history.forget("我");
+    std::stringstream dump1;
+    std::stringstream dump2;
+    history.dump(dump1);
+    history2.dump(dump2);
+    FCITX_ASSERT(dump1.str() == dump2.str());
+    FCITX_ASSERT(history.score("你", "坏") == history2.score("你", "坏"));
+    FCITX_ASSERT(history.score("他", "好") == history2.score("他", "好"));
+
+    // Clear is also replayed.
+    std::stringstream log2;
+    history2.clear();
+    history2.saveLog(log2);
+    history.loadLog(log2);
+    FCITX_ASSERT(history.isUnknown("你"));
+
+    std::stringstream ss;
+    history2.save(ss);
+    FCITX_ASSERT(history2.logSize() == 0);
+
+    // Too many changes can only be kept by save.
+    std::stringstream log3;
+    for (size_t i = 0; i < 10000; i++) {
+        history2.add({"你", std::to_string(i)});
+    }
+    FCITX_ASSERT(!history2.saveLog(log3));
+    FCITX_ASSERT(log3.str().empty());
+    history2.save(ss);
+    history2.add({"你", "好"});
+    FCITX_ASSERT(history2.saveLog(log3));
+    FCITX_ASSERT(history2.logSize() == 1);
+
+    // A damaged log may have an add without words, which is skipped.
+    for (uint32_t halfLife : {0, 16}) {
+        std::stringstream damaged;
+        marshall(damaged, static_cast<uint32_t>(0x000fc316));
+        marshall(damaged, static_cast<uint32_t>(1));
+        marshall(damaged, static_cast<uint32_t>(2));
+        marshall(damaged, static_cast<uint8_t>(0));
+        marshall(damaged, static_cast<uint32_t>(0));
+        marshall(damaged, static_cast<uint8_t>(0));
+        marshall(damaged, static_cast<uint32_t>(1));
+        marshallString(damaged, "你");
+        HistoryBigram history3;
+        history3.setDecayHalfLife(halfLife);
+        history3.loadLog(damaged);
+        FCITX_ASSERT(history3.logSize() == 2);
+        FCITX_ASSERT(!history3.isUnknown("你"));
+    }
+}
+
+void testLoadReplayFormat() {
+    using namespace libime;
+    HistoryBigram history;
+    history.add({"你", "好"});
+    history.add({"你", "坏"});
+
+    // Version 2 only has the sentences of each pool, from old to new.
+    std::stringstream ss;
+    marshall(ss, static_cast<uint32_t>(0x000fc315));
+    marshall(ss, static_cast<uint32_t>(2));
+    marshall(ss, static_cast<uint32_t>(2));
+    for (const auto &sentence : {std::vector<std::string>{"你", "好"},
+                                 std::vector<std::string>{"你", "坏"}}) {
+        marshall(ss, static_cast<uint32_t>(sentence.size()));
+        for (const auto &word : sentence) {
+            marshallString(ss, word);
+        }
+    }
+    marshall(ss, static_cast<uint32_t>(0));
+    marshall(ss, static_cast<uint32_t>(0));
+
+    HistoryBigram history2;
+    history2.load(ss);
+    std::stringstream dump1;
+    std::stringstream dump2;
+    history.dump(dump1);
+    history2.dump(dump2);
+    FCITX_ASSERT(dump1.str() == dump2.str());
+    FCITX_ASSERT(history.score("你", "坏") == history2.score("你", "坏"));
+
+    // Saved again as snapshot.
+    std::stringstream snapshot;
+    history2.save(snapshot);
+    HistoryBigram history3;
+    history3.load(snapshot);
+    std::stringstream dump3;
+    history3.dump(dump3);
+    FCITX_ASSERT(dump1.str() == dump3.str());
+    FCITX_ASSERT(history.score("你", "坏") == history3.score("你", "坏"));
+    FCITX_ASSERT(history.score("", "你") == history3.score("", "你"));
+}
+
+void testDecay() {
+    using namespace libime;
+    HistoryBigram history;
+    auto unknown = history.score("你", "好");
+    history.add({"你", "好"});
+    history.add({"你", "坏"});
+    auto poolScore = history.score("你", "好");
+    // Sentences in pools are converted.
+    history.setDecayHalfLife(4);
+    FCITX_ASSERT(history.decayHalfLife() == 4);
+    FCITX_ASSERT(history.score("你", "好") > unknown);
+    FCITX_ASSERT(history.score("你", "好") < history.score("你", "坏"));
+
+    history.add({"你", "好"});
+    auto score = history.score("你", "好");
+    FCITX_ASSERT(score > history.score("你", "坏"));
+    for (int i = 0; i < 4; i++) {
+        history.add({"他"});
+    }
+    // Older counts weigh less.
+    FCITX_ASSERT(history.score("", "你") < history.score("", "他"));
+
+    std::stringstream ss;
+    history.save(ss);
+    HistoryBigram history2;
+    history2.load(ss);
+    FCITX_ASSERT(history2.decayHalfLife() == 4);
+    FCITX_ASSERT(history.score("你", "好") == history2.score("你", "好"));
+    std::stringstream dump1;
+    std::stringstream dump2;
+    history.dump(dump1);
+    history2.dump(dump2);
+    FCITX_ASSERT(dump1.str() == dump2.str());
+
+    history.forget("好");
+    FCITX_ASSERT(history.isUnknown("好"));
+    FCITX_ASSERT(history.score("你", "坏") > unknown);
+
+    // Counts not seen for a long time are dropped.
+    for (int i = 0; i < 100; i++) {
+        history.add({"他"});
+    }
+    FCITX_ASSERT(history.isUnknown("你"));
+    FCITX_ASSERT(!history.isUnknown("他"));
+
+    history.setDecayHalfLife(0);
+    FCITX_ASSERT(history.isUnknown("他"));
+    history.add({"你", "好"});
+    history.add({"你", "坏"});
+    FCITX_ASSERT(history.score("你", "好") == poolScore);
+}
+
+void testTrigram() {
+    using namespace libime;
+    HistoryBigram history;
+    history.add({"我", "喜欢", "苹果"});
+    history.add({"你", "喜欢", "香蕉"});
+    // Score cur after the sentence start and words.
+    auto score = [&history](const std::vector<std::string> &words,
+                            const std::string &cur) {
+        std::string prev;
+        auto context = history.context(prev);
+        for (const auto &word : words) {
+            context = history.nextContext(context, prev, word);
+            prev = word;
+        }
+        return history.score(context, prev, cur);
+    };
+    FCITX_ASSERT(score({"我", "喜欢"}, "苹果") == score({"你", "喜欢"}, "苹果"));
+
+    // Trigrams of sentences in pools are counted.
+    history.setUseTrigram(true);
+    FCITX_ASSERT(score({"我", "喜欢"}, "苹果") > score({"我", "喜欢"}, "香蕉"));
+    FCITX_ASSERT(score({"你", "喜欢"}, "苹果") < score({"你", "喜欢"}, "香蕉"));
+    FCITX_ASSERT(score({"他", "喜欢"}, "苹果") == score({"他", "喜欢"}, "香蕉"));
+    FCITX_ASSERT(history.score("喜欢", "苹果") == history.score("喜欢", "香蕉"));
+    // The first trigram starts with the sentence start.
+    history.add({"喜欢", "香蕉"});
+    FCITX_ASSERT(score({"喜欢"}, "香蕉") > score({"喜欢"}, "苹果"));
+
+    std::stringstream ss;
+    history.save(ss);
+    HistoryBigram history2;
+    history2.setUseTrigram(true);
+    history2.load(ss);
+    std::string prev;
+    auto context = history2.context(prev);
+    context = history2.nextContext(context, "", "我");
+    context = history2.nextContext(context, "我", "喜欢");
+    FCITX_ASSERT(history2.score(context, "喜欢", "苹果") ==
+                 score({"我", "喜欢"}, "苹果"));
+
+    history.setDecayHalfLife(8);
+    FCITX_ASSERT(score({"我", "喜欢"}, "苹果") > score({"我", "喜欢"}, "香蕉"));
+    // Fall back to bigram without the trigram context.
+    history.forget("我");
+    FCITX_ASSERT(score({"我", "喜欢"}, "苹果") ==
+                 history.score("喜欢", "苹果"));
+}
+
+void testConcurrent() {
+    using namespace libime;
+    HistoryBigram history;
+    history.setUseTrigram(true);
+    const std::vector<std::string> words = {"我", "喜欢", "你", "苹果", "香蕉"};
+    for (size_t i = 0; i < 100; i++) {
+        history.add({words[i % words.size()], words[(i + 1) % words.size()],
+                     words[(i + 3) % words.size()]});
+    }
+    std::stringstream snapshot;
+    history.save(snapshot);
+
+    // Readers keep a context across words while history changes under them.
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < 4; t++) {
+        readers.emplace_back([&history, &words, t]() {
+            std::string prev;
+            auto context = history.context(prev);
+            for (size_t i = 0; i < 20000; i++) {
+                const auto &cur = words[(i * (t + 1)) % words.size()];
+                HistoryBigramContext next;
+                auto score = history.score(context, prev, cur, next);
+                FCITX_ASSERT(score <= 0 && std::isfinite(score));
+                context = next;
+                prev = cur;
+            }
+        });
+    }
+    for (size_t i = 0; i < 2000; i++) {
+        history.add({words[i % words.size()], words[(i + 2) % words.size()]});
+        if (i % 500 == 0) {
+            history.forget(words[i % words.size()]);
+        }
+    }
+    snapshot.seekg(0);
+    history.load(snapshot);
+    for (auto &reader : readers) {
+        reader.join();
+    }
+
+    // A context from before the changes is not used.
+    auto context = history.context("我");
+    history.add({"我", "喜欢", "香蕉"});
+    HistoryBigramContext next;
+    FCITX_ASSERT(history.score(context, "我", "喜欢", next) ==
+                 history.score("我", "喜欢"));
+    FCITX_ASSERT(history.score(next, "喜欢", "香蕉") ==
+                 history.score(history.nextContext(history.context("我"), "我",
+                                                   "喜欢"),
+                               "喜欢", "香蕉"));
+
+    // An invalid file leaves the history as it is.
+    auto score = history.score("喜欢", "香蕉");
+    std::stringstream invalid;
+    marshall(invalid, static_cast<uint32_t>(0x000fc315));
+    marshall(invalid, static_cast<uint32_t>(0x3));
+    marshall(invalid, static_cast<uint32_t>(100));
+    bool failed = false;
+    try {
+        history.load(invalid);
+    } catch (const std::exception &) {
+        failed = true;
+    }
+    FCITX_ASSERT(failed);
+    FCITX_ASSERT(history.score("喜欢", "香蕉") == score);
+}
+
+void testLoadSentences() {
+    using namespace libime;
+    std::vector<std::string> words;
+    for (int i = 0; i < 300; i++) {
+        words.push_back(std::to_string(i));
+    }
+    // More sentences than pools can hold.
+    std::vector<std::vector<std::string>> sentences;
+    uint32_t seed = 1;
+    for (int i = 0; i < 80000; i++) {
+        auto &sentence = sentences.emplace_back();
+        for (auto size = i % 4; size > 0; size--) {
+            seed = seed * 1103515245 + 12345;
+            sentence.push_back(words[(seed >> 16) % (words.size() - i % 200)]);
+        }
+    }
+
+    for (uint32_t halfLife : {0, 1024}) {
+        HistoryBigram history;
+        HistoryBigram bulk;
+        history.setUseTrigram(true);
+        bulk.setUseTrigram(true);
+        history.setDecayHalfLife(halfLife);
+        bulk.setDecayHalfLife(halfLife);
+        for (const auto &sentence : sentences) {
+            history.add(sentence);
+        }
+        bulk.add({"0", "1"});
+        bulk.loadSentences(sentences, 4);
+        FCITX_ASSERT(bulk.logSize() == 0);
+
+        auto score = [](const HistoryBigram &history,
+                        const std::vector<std::string> &words) {
+            std::string prev;
+            auto context = history.context(prev);
+            float score = 0;
+            for (const auto &word : words) {
+                HistoryBigramContext next;
+                score += history.score(context, prev, word, next);
+                context = next;
+                prev = word;
+            }
+            return score;
+        };
+        for (size_t i = 0; i < words.size(); i++) {
+            const std::vector<std::string> sentence = {
+                words[i], words[(i * 7) % words.size()],
+                words[(i * 13) % words.size()], ""};
+            if (halfLife) {
+                FCITX_ASSERT(std::abs(score(history, sentence) -
+                                      score(bulk, sentence)) < 1e-3);
+            } else {
+                FCITX_ASSERT(score(history, sentence) ==
+                             score(bulk, sentence));
+            }
+        }
+        if (!halfLife) {
+            std::stringstream dump;
+            std::stringstream bulkDump;
+            history.dump(dump);
+            bulk.dump(bulkDump);
+            FCITX_ASSERT(dump.str() == bulkDump.str());
+
+            // Sentences older than capacity are only counted.
+            std::vector<std::vector<std::string>> all;
+            for (size_t round = 0; round < 2; round++) {
+                for (const auto &sentence : sentences) {
+                    if (!sentence.empty()) {
+                        all.push_back(sentence);
+                    }
+                }
+            }
+            const auto capacity = bulk.sentenceCapacity();
+            FCITX_ASSERT(capacity > 0 && capacity < all.size());
+            HistoryBigram full;
+            HistoryBigram tail;
+            full.loadSentences(all);
+            tail.loadSentences({all.end() - capacity, all.end()}, 0,
+                               all.size() - capacity);
+            std::stringstream fullSaved;
+            std::stringstream tailSaved;
+            full.save(fullSaved);
+            tail.save(tailSaved);
+            FCITX_ASSERT(fullSaved.str() == tailSaved.str());
+        } else {
+            FCITX_ASSERT(bulk.sentenceCapacity() == 0);
+        }
+    }
+}
+
 int main() {
     testBasic();
+    testScoreCache();
     testOverflow();
+    testForget();
     testPredict();
     testSaveAndLoad();
+    testLoadReplayFormat();
+    testLog();
+    testDecay();
+    testTrigram();
+    testConcurrent();
+    testLoadSentences();
     return 0;
 }
@@ -10,11 +10,17 @@
 #include "libime/pinyin/pinyincontext.h"
 #include "libime/pinyin/pinyindecoder.h"
 #include "libime/pinyin/pinyindictionary.h"
+#include "libime/pinyin/pinyinencoder.h"
 #include "libime/pinyin/pinyinime.h"
+#include "libime/pinyin/pinyinmatchstate.h"
 #include "testdir.h"
 #include <boost/range/adaptor/transformed.hpp>
 #include <fcitx-utils/log.h>
 #include <fcitx-utils/stringutils.h>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <map>
 #include <sstream>
 
 using namespace libime;
@@ -143,5 +149,67 @@ int main() {
         std::cout << std::endl;
     }
 
+    // Another context reuses the match results of the IME.
+    c.clear();
+    c.type("xianshi");
+    PinyinContext c2(&ime);
+    c2.type("xianshi");
+    FCITX_ASSERT(c.candidates().size() == c2.candidates().size());
+    for (size_t j = 0; j < c.candidates().size(); j++) {
+        FCITX_ASSERT(c.candidates()[j].toString() ==
+                     c2.candidates()[j].toString());
+    }
+    // And sees the change of dictionary made after them.
+    ime.dict()->addWord(PinyinDictionary::UserDict, "xian'shi", "仙石");
+    c2.clear();
+    c2.type("xianshi");
+    FCITX_ASSERT(std::any_of(c2.candidates().begin(), c2.candidates().end(),
+                             [](const SentenceResult &candidate) {
+                                 return candidate.toString() == "仙石";
+                             }));
+
+    // Past the start of the input, the decoder keeps at most frameSize + 1
+    // words of the same segments, so only the cheapest ones are matched.
+    auto segmentWords = [&ime](size_t frameSize) {
+        ime.setFrameSize(frameSize);
+        PinyinContext context(&ime);
+        PinyinMatchState state(&context);
+        auto graph =
+            PinyinEncoder::parseUserPinyin("xianshi", ime.fuzzyFlags());
+        Lattice lattice;
+        ime.decoder()->decode(lattice, graph, 1, ime.model()->nullState(),
+                              std::numeric_limits<float>::max(),
+                              -std::numeric_limits<float>::max(),
+                              Decoder::beamSizeDefault, frameSize, &state);
+        std::map<size_t, std::vector<std::pair<float, std::string>>> words;
+        for (const auto &node : lattice.nodes(&graph.end())) {
+            words[node.from()->index()].emplace_back(node.cost(), node.word());
+        }
+        for (auto &item : words) {
+            std::sort(item.second.begin(), item.second.end(),
+                      std::greater<>());
+        }
+        return words;
+    };
+    auto allWords = segmentWords(0);
+    auto keptWords = segmentWords(2);
+    FCITX_ASSERT(keptWords[0] == allWords[0]);
+    FCITX_ASSERT(!keptWords[4].empty() && keptWords[4].size() <= 3);
+    FCITX_ASSERT(allWords[4].size() > 3);
+    for (size_t j = 0; j < keptWords[4].size(); j++) {
+        FCITX_ASSERT(keptWords[4][j].first == allWords[4][j].first);
+    }
+    // A word made cheaper or removed is updated among them.
+    auto shi = allWords[4].back().second;
+    ime.dict()->addWord(PinyinDictionary::SystemDict, "shi", shi, 0.0f);
+    keptWords = segmentWords(2);
+    FCITX_ASSERT(keptWords[4].front().second == shi);
+    ime.dict()->removeWord(PinyinDictionary::SystemDict, "shi", shi);
+    keptWords = segmentWords(2);
+    FCITX_ASSERT(std::none_of(keptWords[4].begin(), keptWords[4].end(),
+                              [&shi](const auto &word) {
+                                  return word.second == shi;
+                              }));
+
     return 0;
 }
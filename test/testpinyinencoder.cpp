@@ -31,6 +31,16 @@ void check(std::string py, PinyinFuzzyFlags flags) {
     dfs(PinyinEncoder::parseUserPinyin(std::move(py), flags));
 }
 
+std::vector<std::vector<size_t>> paths(const SegmentGraph &segs) {
+    std::vector<std::vector<size_t>> result;
+    segs.dfs([&result](const SegmentGraphBase &,
+                       const std::vector<size_t> &path) {
+        result.push_back(path);
+        return true;
+    });
+    return result;
+}
+
 int main() {
     check("wa'nan'''", PinyinFuzzyFlag::None);
     check("lvenu", PinyinFuzzyFlag::None);
@@ -120,6 +130,52 @@ int main() {
         }
         dfs(graph);
     }
+    for (auto flags :
+         {PinyinFuzzyFlags(PinyinFuzzyFlag::None),
+          PinyinFuzzyFlags{PinyinFuzzyFlag::L_N, PinyinFuzzyFlag::IAN_IANG,
+                           PinyinFuzzyFlag::NG_GN, PinyinFuzzyFlag::Inner}}) {
+        for (std::string_view pinyin :
+             {"niagn", "Nihao", "NI", "m", "zh", "", "'", "xianx", "v"}) {
+            FCITX_ASSERT(PinyinEncoder::cachedStringToSyllables(pinyin,
+                                                                flags) ==
+                         PinyinEncoder::stringToSyllables(pinyin, flags));
+        }
+    }
+    {
+        // Updating a graph gives the segments of parsing it again.
+        auto graph = PinyinEncoder::parseUserPinyin("", PinyinFuzzyFlag::Inner);
+        const std::string longInput = "woaizuguotiananmenwoaizuguotiananmen";
+        for (const auto &input :
+             {std::string("xian"), std::string("xiangongyuan"),
+              std::string("xiangongyu"), std::string("xian'''gongyu"),
+              std::string("xiangon"), longInput, longInput + "x",
+              std::string("ni'hao'xian"), std::string()}) {
+            const auto *start = &graph.start();
+            auto discarded = PinyinEncoder::updateUserPinyin(
+                graph, input, PinyinFuzzyFlag::Inner);
+            FCITX_ASSERT(graph.checkGraph());
+            FCITX_ASSERT(graph.data() == input);
+            FCITX_ASSERT(paths(graph) == paths(PinyinEncoder::parseUserPinyin(
+                                             input, PinyinFuzzyFlag::Inner)));
+            // Appending to a long input only parses its end again.
+            if (input == longInput + "x") {
+                FCITX_ASSERT(!discarded.count(start));
+            }
+        }
+        auto discarded =
+            PinyinEncoder::updateUserPinyin(graph, "", PinyinFuzzyFlag::Inner);
+        FCITX_ASSERT(discarded.empty());
+    }
+    {
+        // A pinyin only valid with a fuzzy flag is one segment only with it.
+        auto graph =
+            PinyinEncoder::parseUserPinyin("zhuagn", PinyinFuzzyFlag::NG_GN);
+        FCITX_ASSERT(graph.start().nextSize() == 1);
+        FCITX_ASSERT(graph.start().nexts().front().index() == 6);
+        auto graph2 =
+            PinyinEncoder::parseUserPinyin("zhuagn", PinyinFuzzyFlag::None);
+        FCITX_ASSERT(graph2.start().nexts().front().index() == 4);
+    }
     {
         auto result =
             PinyinEncoder::stringToSyllables("z", PinyinFuzzyFlag::None);
@@ -17,10 +17,48 @@
 #include <fcitx-utils/stringutils.h>
 #include <fstream>
 #include <functional>
+#include <sstream>
 
 using namespace libime;
 
+void testPredictionTable() {
+    PredictionTable table;
+    table.set("你", {{"好", -1.0f}, {"们", -2.0f}, {"是", -0.5f}});
+    table.set("我", {{"们", -1.0f}, {"的", -0.5f}, {"是", -2.0f}}, 2);
+    table.set("我|是", {{"谁", -0.5f}});
+    // Setting a context again replaces its candidates.
+    table.set("他", {{"们", -1.0f}});
+    table.set("他", {{"的", -0.5f}});
+    FCITX_ASSERT(table.size() == 4);
+
+    std::stringstream ss;
+    table.save(ss);
+    PredictionTable loaded;
+    loaded.load(ss);
+    FCITX_ASSERT(loaded.size() == 4);
+
+    const auto &candidates = loaded.candidates("你");
+    FCITX_ASSERT(candidates.size() == 3);
+    FCITX_ASSERT(candidates[0].first == "是");
+    FCITX_ASSERT(candidates[1].first == "好");
+    FCITX_ASSERT(candidates[2].first == "们");
+    FCITX_ASSERT(candidates[2].second == -2.0f);
+    const auto &candidates2 = loaded.candidates("我");
+    FCITX_ASSERT(candidates2.size() == 2);
+    FCITX_ASSERT(candidates2[0].first == "的");
+    FCITX_ASSERT(candidates2[1].first == "们");
+    FCITX_ASSERT(loaded.candidates("他").size() == 1);
+    FCITX_ASSERT(loaded.candidates("他")[0].first == "的");
+    FCITX_ASSERT(loaded.candidates("她").empty());
+    FCITX_ASSERT(loaded.candidates("我", "是").size() == 1);
+    FCITX_ASSERT(loaded.candidates("我", "是")[0].first == "谁");
+    FCITX_ASSERT(loaded.candidates("我", "们").empty());
+    FCITX_ASSERT(loaded.candidates("你", "是").empty());
+}
+
 int main() {
+    testPredictionTable();
+
     UserLanguageModel model(LIBIME_BINARY_DIR "/data/sc.lm");
     Prediction pred;
     pred.setUserLanguageModel(&model);
@@ -32,5 +70,25 @@ int main() {
         FCITX_LOG(Info) << result;
     }
 
+    State state;
+    WordNode node("你", model.index("你"));
+    model.score(model.nullState(), node, state);
+    std::vector<std::string> sentence{"你"};
+    auto expect = pred.predict(state, sentence, 10);
+    PredictionBuffer buffer;
+    for (int i = 0; i < 2; i++) {
+        pred.predict(state, sentence, 10, buffer);
+        FCITX_ASSERT(buffer.size() == expect.size());
+        for (size_t j = 0; j < buffer.size(); j++) {
+            FCITX_ASSERT(buffer.candidates()[j].first == expect[j]);
+            if (j) {
+                FCITX_ASSERT(buffer.candidates()[j - 1].second >=
+                             buffer.candidates()[j].second);
+            }
+        }
+    }
+    auto all = pred.predict(state, sentence);
+    FCITX_ASSERT(std::find(all.begin(), all.end(), "希望") != all.end());
+
     return 0;
 }
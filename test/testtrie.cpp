@@ -23,5 +23,27 @@ int main() {
     FCITX_ASSERT(trie.isNoValue(result));
     trie.erase(pos);
     FCITX_ASSERT(trie.size() == 4);
+
+    pos = 0;
+    trie.traverse("aa", pos);
+    FCITX_ASSERT(trie.childMask(pos, 'a') == 0b11);
+    pos = 0;
+    trie.traverse("aab", pos);
+    FCITX_ASSERT(trie.childMask(pos, 'a') == 0);
+    trie.set("aabc", 1);
+    pos = 0;
+    trie.traverse("aab", pos);
+    FCITX_ASSERT(trie.childMask(pos, 'a') == 0b100);
+    FCITX_ASSERT(trie.childMask(pos, 'd') == 0);
+
+    // Read back part of the key at a position in the middle of a tail.
+    trie.set("xyzw", 1);
+    pos = 0;
+    trie.traverse("xyz", pos);
+    std::string key;
+    trie.suffix(key, 2, pos);
+    FCITX_ASSERT(key == "yz");
+    trie.suffix(key, 3, pos);
+    FCITX_ASSERT(key == "xyz");
     return 0;
 }
@@ -5,20 +5,121 @@
  */
 
 #include "libime/core/historybigram.h"
+#include <cstring>
 #include <fstream>
 #include <getopt.h>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
 
 void usage(const char *argv0) {
-    std::cout << "Usage: " << argv0 << " <source> <dest>" << std::endl
+    std::cout << "Usage: " << argv0 << " [-l <log>] <source> <dest>"
+              << std::endl
+              << "       " << argv0
+              << " -i [-d <halflife>] [-3] [-j <threads>] <corpus> <dest>"
+              << std::endl
+              << "-l: Replay the history log on top of source" << std::endl
+              << "-i: Import a corpus with one sentence per line, words "
+                 "separated by space,"
+              << std::endl
+              << "    and save it as a binary history. Without -d, only the "
+                 "newest "
+              << libime::HistoryBigram().sentenceCapacity() << std::endl
+              << "    sentences fit in history, and older ones are skipped "
+                 "while reading"
+              << std::endl
+              << "-d: Use time decayed counts with the half life in "
+                 "sentences, requires -i."
+              << std::endl
+              << "    Every sentence is counted, so the whole corpus is read "
+                 "into memory"
+              << std::endl
+              << "-3: Also count trigrams, requires -i" << std::endl
+              << "-j: Number of threads to count with, default is one per "
+                 "core"
+              << std::endl
               << "-h: Show this help" << std::endl;
 }
 
+int importHistory(const char *corpus, const char *dest, uint32_t halfLife,
+                  bool trigram, size_t threads) {
+    using namespace libime;
+    HistoryBigram history;
+    history.setUseTrigram(trigram);
+    history.setDecayHalfLife(halfLife);
+    // Sentences older than capacity are only counted by loadSentences, so
+    // only keep the tail of corpus in memory.
+    const auto capacity = history.sentenceCapacity();
+    std::vector<std::vector<std::string>> sentences;
+    size_t dropped = 0;
+    {
+        std::ifstream in(corpus, std::ios::in | std::ios::binary);
+        if (!in) {
+            std::cerr << "Failed to open " << corpus << std::endl;
+            return 1;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream words(line);
+            std::vector<std::string> sentence;
+            std::string word;
+            while (words >> word) {
+                sentence.push_back(std::move(word));
+            }
+            if (sentence.empty()) {
+                continue;
+            }
+            // Drop the older half at once, so each sentence is moved at
+            // most once.
+            if (capacity && sentences.size() == capacity * 2) {
+                sentences.erase(sentences.begin(),
+                                sentences.begin() + capacity);
+                dropped += capacity;
+            }
+            sentences.push_back(std::move(sentence));
+        }
+    }
+
+    history.loadSentences(sentences, threads, dropped);
+
+    std::ofstream fout;
+    std::ostream *out;
+    if (strcmp(dest, "-") == 0) {
+        out = &std::cout;
+    } else {
+        fout.open(dest, std::ios::out | std::ios::binary);
+        out = &fout;
+    }
+    history.save(*out);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
 
+    const char *log = nullptr;
+    bool importCorpus = false;
+    uint32_t halfLife = 0;
+    bool trigram = false;
+    size_t threads = 0;
     int c;
-    while ((c = getopt(argc, argv, "h")) != -1) {
+    while ((c = getopt(argc, argv, "l:id:3j:h")) != -1) {
         switch (c) {
+        case 'l':
+            log = optarg;
+            break;
+        case 'i':
+            importCorpus = true;
+            break;
+        case 'd':
+            halfLife = std::stoul(optarg);
+            break;
+        case '3':
+            trigram = true;
+            break;
+        case 'j':
+            threads = std::stoul(optarg);
+            break;
         case 'h':
             usage(argv[0]);
             return 0;
@@ -32,11 +133,19 @@ int main(int argc, char *argv[]) {
         usage(argv[0]);
         return 1;
     }
+    if (importCorpus) {
+        return importHistory(argv[optind], argv[optind + 1], halfLife,
+                             trigram, threads);
+    }
     using namespace libime;
     HistoryBigram history;
 
     std::ifstream in(argv[optind], std::ios::in | std::ios::binary);
     history.load(in);
+    if (log) {
+        std::ifstream logIn(log, std::ios::in | std::ios::binary);
+        history.loadLog(logIn);
+    }
 
     std::ofstream fout;
     std::ostream *out;
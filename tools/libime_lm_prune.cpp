@@ -0,0 +1,506 @@
+/*
+ * SPDX-FileCopyrightText: 2026-2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "libime/core/constants.h"
+#include "libime/core/languagemodel.h"
+#include "libime/core/lattice.h"
+#include "libime/core/prediction.h"
+#include "lm/model.hh"
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+void usage(const char *argv0) {
+    std::cout << "Usage: " << argv0
+              << " [-t <threshold>] [-k <max>] [-c <corpus>] [-f <score>] "
+                 "[-g <score>] [-s <maxSize>] [-b <binary>] <source> <dest>"
+              << std::endl
+              << "Prune an ARPA language model and build <dest> and "
+                 "<dest>.predict from it."
+              << std::endl
+              << "-t: Prune n-grams whose weighted log probability "
+                 "difference to the backoff is less than threshold"
+              << std::endl
+              << "-k: Keep at most max n-grams for each order above unigram"
+              << std::endl
+              << "-c: Report the perplexity of <source> and <dest> on a "
+                 "held-out corpus, one segmented sentence per line. It is "
+                 "only reported, and does not change what is pruned"
+              << std::endl
+              << "-f: Set score filter of bigram prediction, on the score of "
+                 "both words"
+              << std::endl
+              << "-g: Set score filter of trigram prediction, on the score "
+                 "of the last word after the other two"
+              << std::endl
+              << "-s: Set max number of prediction per word" << std::endl
+              << "-b: Compare the size of <dest> with this binary model. By "
+                 "default <source> is"
+              << std::endl
+              << "    built without pruning, the same way as <dest>, to "
+                 "compare with"
+              << std::endl
+              << "-h: Show this help" << std::endl;
+}
+
+using namespace libime;
+
+namespace {
+
+struct NGramEntry {
+    float prob = 0;
+    float backoff = 0;
+};
+
+// Key of the table is the words of n-gram joined by space.
+using NGramTable = std::unordered_map<std::string, NGramEntry>;
+
+std::string join(const std::vector<std::string> &words, size_t begin,
+                 size_t end, char sep = ' ') {
+    std::string result;
+    for (size_t i = begin; i < end; i++) {
+        if (i != begin) {
+            result += sep;
+        }
+        result += words[i];
+    }
+    return result;
+}
+
+std::vector<std::string> split(const std::string &key) {
+    std::vector<std::string> words;
+    boost::split(words, key, boost::is_any_of(" "));
+    return words;
+}
+
+class ArpaModel {
+public:
+    void load(std::istream &in) {
+        std::string line;
+        auto isSpaceCheck = boost::is_any_of(" \n\t\r\v\f");
+        size_t order = 0;
+        while (std::getline(in, line)) {
+            boost::trim_if(line, isSpaceCheck);
+            if (line.empty() || line == "\\data\\") {
+                continue;
+            }
+            if (line == "\\end\\") {
+                break;
+            }
+            if (boost::starts_with(line, "ngram ")) {
+                auto n = std::stoul(line.substr(6, line.find('=') - 6));
+                if (n > orders_.size()) {
+                    orders_.resize(n);
+                }
+                continue;
+            }
+            if (line.front() == '\\' && boost::ends_with(line, "-grams:")) {
+                order = std::stoul(line.substr(1));
+                if (order == 0 || order > orders_.size()) {
+                    throw std::invalid_argument("Invalid ARPA file.");
+                }
+                continue;
+            }
+            if (order == 0) {
+                continue;
+            }
+            std::vector<std::string> tokens;
+            boost::split(tokens, line, isSpaceCheck,
+                         boost::token_compress_on);
+            if (tokens.size() < order + 1) {
+                continue;
+            }
+            NGramEntry entry;
+            entry.prob = std::stof(tokens[0]);
+            if (tokens.size() > order + 1) {
+                entry.backoff = std::stof(tokens[order + 1]);
+            }
+            orders_[order - 1][join(tokens, 1, order + 1)] = entry;
+        }
+        if (orders_.empty()) {
+            throw std::invalid_argument("Invalid ARPA file.");
+        }
+        auto unk = orders_[0].find("<unk>");
+        if (unk != orders_[0].end()) {
+            unknown_ = unk->second.prob;
+        }
+    }
+
+    void save(std::ostream &out) const {
+        out << "\\data\\" << std::endl;
+        for (size_t n = 1; n <= orders_.size(); n++) {
+            out << "ngram " << n << "=" << orders_[n - 1].size() << std::endl;
+        }
+        for (size_t n = 1; n <= orders_.size(); n++) {
+            out << std::endl << "\\" << n << "-grams:" << std::endl;
+            std::vector<const NGramTable::value_type *> entries;
+            for (const auto &item : orders_[n - 1]) {
+                entries.push_back(&item);
+            }
+            std::sort(entries.begin(), entries.end(),
+                      [](const auto *lhs, const auto *rhs) {
+                          return lhs->first < rhs->first;
+                      });
+            for (const auto *entry : entries) {
+                out << entry->second.prob << '\t' << entry->first;
+                if (n != orders_.size()) {
+                    out << '\t' << entry->second.backoff;
+                }
+                out << std::endl;
+            }
+        }
+        out << std::endl << "\\end\\" << std::endl;
+    }
+
+    size_t order() const { return orders_.size(); }
+    const NGramTable &table(size_t n) const { return orders_[n - 1]; }
+    NGramTable &table(size_t n) { return orders_[n - 1]; }
+
+    float backoff(const std::vector<std::string> &words, size_t begin,
+                  size_t end) const {
+        auto &table = orders_[end - begin - 1];
+        auto iter = table.find(join(words, begin, end));
+        return iter == table.end() ? 0 : iter->second.backoff;
+    }
+
+    /// log10 P(words[end - 1] | words[begin, end - 1]).
+    float logProb(const std::vector<std::string> &words, size_t begin,
+                  size_t end) const {
+        float result = 0;
+        for (size_t i = begin; i < end; i++) {
+            auto &table = orders_[end - i - 1];
+            auto iter = table.find(join(words, i, end));
+            if (iter != table.end()) {
+                return result + iter->second.prob;
+            }
+            if (i + 1 < end) {
+                result += backoff(words, i, end - 1);
+            }
+        }
+        return result + unknown_;
+    }
+
+    /// log10 P(words[begin, end)), a leading <s> is not counted.
+    float historyLogProb(const std::vector<std::string> &words, size_t begin,
+                         size_t end) const {
+        float result = 0;
+        for (size_t i = begin; i < end; i++) {
+            if (i == begin && words[i] == "<s>") {
+                continue;
+            }
+            result += logProb(words, begin, i + 1);
+        }
+        return result;
+    }
+
+    /// Remove the n-grams of given order whose removal changes the model the
+    /// least, the criterion is the weighted difference of log probability:
+    ///   P(h, w) * (log P(w | h) - log (bow(h) P(w | h')))
+    /// N-grams still used as context or suffix by a higher order are kept.
+    size_t prune(size_t n, double threshold, size_t maxSize) {
+        std::unordered_set<std::string> needed;
+        if (n < orders_.size()) {
+            for (const auto &item : orders_[n]) {
+                auto words = split(item.first);
+                needed.insert(join(words, 0, n));
+                needed.insert(join(words, 1, n + 1));
+            }
+        }
+
+        std::vector<std::pair<double, const std::string *>> candidates;
+        size_t kept = 0;
+        for (const auto &item : orders_[n - 1]) {
+            if (needed.count(item.first)) {
+                kept++;
+                continue;
+            }
+            auto words = split(item.first);
+            auto lower = backoff(words, 0, n - 1) + logProb(words, 1, n);
+            auto weight = std::pow(10.0, historyLogProb(words, 0, n - 1) +
+                                             item.second.prob);
+            candidates.emplace_back(weight * (item.second.prob - lower),
+                                    &item.first);
+        }
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const auto &lhs, const auto &rhs) {
+                      if (lhs.first != rhs.first) {
+                          return lhs.first > rhs.first;
+                      }
+                      return *lhs.second < *rhs.second;
+                  });
+
+        std::vector<std::string> removed;
+        for (const auto &candidate : candidates) {
+            if (candidate.first < threshold ||
+                (maxSize > 0 && kept >= maxSize)) {
+                removed.push_back(*candidate.second);
+            } else {
+                kept++;
+            }
+        }
+        for (const auto &key : removed) {
+            orders_[n - 1].erase(key);
+        }
+        return removed.size();
+    }
+
+    /// Recompute backoff weights so the pruned model is normalized again.
+    void renormalize() {
+        for (size_t n = 1; n < orders_.size(); n++) {
+            std::unordered_map<std::string, std::pair<double, double>> sums;
+            for (const auto &item : orders_[n]) {
+                auto words = split(item.first);
+                auto &sum = sums[join(words, 0, n)];
+                sum.first += std::pow(10.0, item.second.prob);
+                sum.second += std::pow(10.0, logProb(words, 1, n + 1));
+            }
+            for (auto &item : orders_[n - 1]) {
+                auto iter = sums.find(item.first);
+                if (iter == sums.end()) {
+                    item.second.backoff = 0;
+                    continue;
+                }
+                auto numerator = 1.0 - iter->second.first;
+                auto denominator = 1.0 - iter->second.second;
+                if (numerator > 0 && denominator > 0) {
+                    item.second.backoff =
+                        std::log10(numerator / denominator);
+                }
+            }
+        }
+    }
+
+private:
+    std::vector<NGramTable> orders_;
+    float unknown_ = -100;
+};
+
+struct Perplexity {
+    size_t sentences = 0;
+    size_t words = 0;
+    size_t oovs = 0;
+    double logProb = 0;
+
+    double value() const {
+        auto count = words + sentences;
+        return count ? std::pow(10.0, -logProb / count) : 0;
+    }
+};
+
+// Unknown words are scored with the unknown penalty of LanguageModel, the
+// same way as the decoder sees them.
+Perplexity perplexity(const LanguageModel &model, const char *corpus) {
+    Perplexity result;
+    std::ifstream in(corpus, std::ios::in | std::ios::binary);
+    std::string line;
+    auto isSpaceCheck = boost::is_any_of(" \n\t\r\v\f");
+    while (std::getline(in, line)) {
+        boost::trim_if(line, isSpaceCheck);
+        if (line.empty()) {
+            continue;
+        }
+        std::vector<std::string> words;
+        boost::split(words, line, isSpaceCheck, boost::token_compress_on);
+        State state = model.beginState(), outState;
+        for (const auto &word : words) {
+            WordNode node(word, model.index(word));
+            if (model.isUnknown(node.idx(), word)) {
+                result.oovs++;
+            }
+            result.logProb += model.score(state, node, outState);
+            state = outState;
+        }
+        WordNode end("</s>", model.endSentence());
+        result.logProb += model.score(state, end, outState);
+        result.words += words.size();
+        result.sentences++;
+    }
+    return result;
+}
+
+void printPerplexity(const char *name, const Perplexity &p) {
+    std::cout << name << ": " << p.sentences << " sentences, " << p.words
+              << " words, " << p.oovs << " OOVs, perplexity " << p.value()
+              << std::endl;
+}
+
+int64_t fileSize(const std::string &file) {
+    std::ifstream fin(file, std::ios::in | std::ios::binary | std::ios::ate);
+    return fin ? static_cast<int64_t>(fin.tellg()) : -1;
+}
+
+// Removed when it goes out of scope, also if building it throws.
+struct TemporaryFile {
+    explicit TemporaryFile(std::string path) : path_(std::move(path)) {}
+    ~TemporaryFile() { std::remove(path_.c_str()); }
+    TemporaryFile(const TemporaryFile &) = delete;
+    TemporaryFile &operator=(const TemporaryFile &) = delete;
+
+    std::string path_;
+};
+
+// Build the binary the same way as the bundled model, a quantized trie.
+void buildBinary(const std::string &arpaFile, const std::string &dest) {
+    lm::ngram::Config config;
+    config.sentence_marker_missing = lm::SILENT;
+    config.write_mmap = dest.c_str();
+    config.write_method = lm::ngram::Config::WRITE_AFTER;
+    config.prob_bits = 8;
+    config.backoff_bits = 8;
+    config.pointer_bhiksha_bits = 22;
+    lm::ngram::QuantArrayTrieModel model(arpaFile.c_str(), config);
+}
+
+void buildPrediction(const ArpaModel &arpa, const LanguageModel &model,
+                     float filter, float trigramFilter, size_t maxSize,
+                     const std::string &file) {
+    std::unordered_map<std::string, PredictionTable::CandidateList> word;
+    // Context is the last one or two words.
+    for (size_t n = 2; n <= std::min<size_t>(arpa.order(), 3); n++) {
+        for (const auto &item : arpa.table(n)) {
+            auto words = split(item.first);
+            // We don't want prediction generate <unk>
+            if (words.back() == "<unk>") {
+                continue;
+            }
+            State state = model.nullState(), outState;
+            float s = 0, last = 0;
+            for (const auto &w : words) {
+                WordNode node(w, model.index(w));
+                last = model.score(state, node, outState);
+                s += last;
+                state = outState;
+            }
+            // The joint score of a trigram is always lower than its bigram,
+            // so filter trigram by how likely the word is after its context.
+            if (n == 2 ? s > filter : last > trigramFilter) {
+                word[join(words, 0, n - 1, '|')].emplace_back(words.back(),
+                                                              last);
+            }
+        }
+    }
+
+    PredictionTable table;
+    for (auto &p : word) {
+        table.set(p.first, std::move(p.second), maxSize);
+    }
+
+    std::ofstream fout(file, std::ios::out | std::ios::binary);
+    table.save(fout);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    int c;
+    double threshold = 0;
+    size_t maxNGrams = 0;
+    const char *corpus = nullptr;
+    unsigned long maxSize = 15;
+    float filter =
+        std::log10(libime::DEFAULT_LANGUAGE_MODEL_UNKNOWN_PROBABILITY_PENALTY) +
+        1;
+    float trigramFilter = filter;
+    const char *baseline = nullptr;
+    while ((c = getopt(argc, argv, "t:k:c:f:g:s:b:h")) != -1) {
+        switch (c) {
+        case 't':
+            threshold = std::stod(optarg);
+            break;
+        case 'k':
+            maxNGrams = std::stoul(optarg);
+            break;
+        case 'c':
+            corpus = optarg;
+            break;
+        case 'f':
+            filter = std::stof(optarg);
+            break;
+        case 'g':
+            trigramFilter = std::stof(optarg);
+            break;
+        case 's':
+            maxSize = std::stoul(optarg);
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind + 2 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *source = argv[optind];
+    std::string dest = argv[optind + 1];
+
+    ArpaModel arpa;
+    {
+        std::ifstream in(source, std::ios::in | std::ios::binary);
+        arpa.load(in);
+    }
+    if (arpa.order() < 2) {
+        std::cerr << "Language model needs to be at least bigram." << std::endl;
+        return 1;
+    }
+
+    for (size_t n = arpa.order(); n >= 2; n--) {
+        auto before = arpa.table(n).size();
+        auto removed = arpa.prune(n, threshold, maxNGrams);
+        std::cout << n << "-grams: " << before << " -> " << before - removed
+                  << std::endl;
+    }
+    arpa.renormalize();
+
+    {
+        TemporaryFile arpaFile(dest + ".arpa");
+        {
+            std::ofstream out(arpaFile.path_, std::ios::out | std::ios::binary);
+            arpa.save(out);
+        }
+        buildBinary(arpaFile.path_, dest);
+    }
+
+    // Comparing with the text source would mostly show the binary format.
+    int64_t baselineSize = 0;
+    if (baseline) {
+        baselineSize = fileSize(baseline);
+    } else {
+        TemporaryFile unpruned(dest + ".unpruned");
+        buildBinary(source, unpruned.path_);
+        baselineSize = fileSize(unpruned.path_);
+    }
+
+    LanguageModel model(dest.c_str());
+    auto predictFile = dest + ".predict";
+    buildPrediction(arpa, model, filter, trigramFilter, maxSize, predictFile);
+
+    std::cout << "Size: " << baselineSize << " -> " << fileSize(dest)
+              << " bytes, prediction " << fileSize(predictFile) << " bytes"
+              << std::endl;
+
+    if (corpus) {
+        printPerplexity(source, perplexity(LanguageModel(source), corpus));
+        printPerplexity(dest.c_str(), perplexity(model, corpus));
+    }
+    return 0;
+}
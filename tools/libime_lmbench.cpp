@@ -0,0 +1,215 @@
+/*
+ * SPDX-FileCopyrightText: 2026-2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "libime/core/historybigram.h"
+#include "libime/core/languagemodel.h"
+#include "libime/core/lattice.h"
+#include "libime/core/userlanguagemodel.h"
+#include "libime/pinyin/pinyindecoder.h"
+#include "libime/pinyin/pinyindictionary.h"
+#include "libime/pinyin/pinyinencoder.h"
+#include <algorithm>
+#include <chrono>
+#include <dlfcn.h>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Entry point of a plugin passed to -p.
+constexpr char createFunction[] = "libime_lmbench_create";
+using CreateFunction = libime::LanguageModelBase *(const char *file);
+
+void usage(const char *argv0) {
+    std::cout << "Usage: " << argv0
+              << " [-n <nbest>] [-u <history>] [-3] [-p <plugin>] <dict> "
+                 "<trace> <model> [<model>...]"
+              << std::endl
+              << "Replay a keystroke trace against each language model."
+              << std::endl
+              << "A model is any kenlm binary, e.g. trie or probing, unless "
+                 "-p is used."
+              << std::endl
+              << "The trace contains whitespace separated tokens: a single "
+                 "letter or ' is typed,"
+              << std::endl
+              << "\"back\" removes the last key, a digit or \"reset\" ends "
+                 "the current input."
+              << std::endl
+              << "-n: Set the number of sentences to decode, default is 1"
+              << std::endl
+              << "-u: Decode with the user history on top of each model"
+              << std::endl
+              << "-3: Use the trigram of user history, requires -u"
+              << std::endl
+              << "-p: Load each model with a plugin, a shared library that "
+                 "exports"
+              << std::endl
+              << "    extern \"C\" libime::LanguageModelBase *"
+              << createFunction << "(const char *file)" << std::endl
+              << "    so other LanguageModelBase backends can be compared, "
+                 "can't be used with -u"
+              << std::endl
+              << "-h: Show this help" << std::endl;
+}
+
+using namespace libime;
+
+struct BenchResult {
+    size_t keys = 0;
+    int64_t total = 0;
+    int64_t max = 0;
+};
+
+// Decode from scratch on every keystroke, so the cost is dominated by the
+// language model. The model is bound to the dictionary like PinyinIME does,
+// so word indices are resolved by the dictionary.
+BenchResult replay(PinyinDictionary &dict, const LanguageModelBase &model,
+                   const std::vector<std::string> &trace, size_t nbest) {
+    dict.setLanguageModel(&model);
+    PinyinDecoder decoder(&dict, &model);
+    BenchResult result;
+    std::string input;
+    for (const auto &token : trace) {
+        if (token == "back") {
+            if (!input.empty()) {
+                input.pop_back();
+            }
+        } else if (token.size() == 1 &&
+                   (('a' <= token[0] && token[0] <= 'z') ||
+                    (!input.empty() && token[0] == '\''))) {
+            input.append(token);
+        } else {
+            input.clear();
+            continue;
+        }
+        if (input.empty()) {
+            continue;
+        }
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        auto graph =
+            PinyinEncoder::parseUserPinyin(input, PinyinFuzzyFlag::Inner);
+        Lattice lattice;
+        decoder.decode(lattice, graph, nbest, model.nullState());
+        auto t = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::high_resolution_clock::now() - t0)
+                     .count();
+        result.keys++;
+        result.total += t;
+        result.max = std::max<int64_t>(result.max, t);
+    }
+    dict.setLanguageModel(nullptr);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    size_t nbest = 1;
+    const char *history = nullptr;
+    bool trigram = false;
+    const char *plugin = nullptr;
+    int c;
+    while ((c = getopt(argc, argv, "n:u:3p:h")) != -1) {
+        switch (c) {
+        case 'n':
+            nbest = std::stoul(optarg);
+            break;
+        case 'u':
+            history = optarg;
+            break;
+        case '3':
+            trigram = true;
+            break;
+        case 'p':
+            plugin = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind + 3 > argc || (trigram && !history) || (plugin && history)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    CreateFunction *create = nullptr;
+    if (plugin) {
+        // The library is kept loaded until exit, since models are from it.
+        auto *handle = dlopen(plugin, RTLD_NOW);
+        if (handle) {
+            create = reinterpret_cast<CreateFunction *>(
+                dlsym(handle, createFunction));
+        }
+        if (!create) {
+            std::cerr << "Failed to load " << plugin << ": " << dlerror()
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    PinyinDictionary dict;
+    dict.load(PinyinDictionary::SystemDict, argv[optind],
+              PinyinDictFormat::Binary);
+
+    std::vector<std::string> trace;
+    {
+        std::ifstream fin(argv[optind + 1], std::ios::in | std::ios::binary);
+        if (!fin) {
+            std::cerr << "Failed to open " << argv[optind + 1] << std::endl;
+            return 1;
+        }
+        std::string token;
+        while (fin >> token) {
+            trace.push_back(token);
+        }
+    }
+
+    for (int i = optind + 2; i < argc; i++) {
+        std::ifstream fin(argv[i],
+                          std::ios::in | std::ios::binary | std::ios::ate);
+        auto fileSize = fin ? static_cast<int64_t>(fin.tellg()) : -1;
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        std::unique_ptr<LanguageModelBase> model;
+        if (create) {
+            model.reset(create(argv[i]));
+            if (!model) {
+                std::cerr << "Failed to load " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (history) {
+            auto userModel = std::make_unique<UserLanguageModel>(argv[i]);
+            userModel->history().setUseTrigram(trigram);
+            std::ifstream historyIn(history, std::ios::in | std::ios::binary);
+            if (!historyIn) {
+                std::cerr << "Failed to open " << history << std::endl;
+                return 1;
+            }
+            userModel->load(historyIn);
+            model = std::move(userModel);
+        } else {
+            model = std::make_unique<LanguageModel>(argv[i]);
+        }
+        auto load = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::high_resolution_clock::now() - t0)
+                        .count();
+
+        auto result = replay(dict, *model, trace, nbest);
+        std::cout << argv[i] << ": size " << fileSize << " bytes, load "
+                  << load << " ms, " << result.keys << " keys, total "
+                  << result.total / 1000000.0 << " ms, average "
+                  << (result.keys ? result.total / result.keys / 1000.0 : 0)
+                  << " us, max " << result.max / 1000.0 << " us" << std::endl;
+    }
+    return 0;
+}
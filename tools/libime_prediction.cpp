@@ -5,8 +5,9 @@
  */
 
 #include "libime/core/constants.h"
-#include "libime/core/datrie.h"
 #include "libime/core/languagemodel.h"
+#include "libime/core/lattice.h"
+#include "libime/core/prediction.h"
 #include <boost/algorithm/string.hpp>
 #include <cmath>
 #include <fcitx-utils/log.h>
@@ -19,16 +20,30 @@
 
 void usage(const char *argv0) {
     std::cout << "Usage: " << argv0
-              << " [-f <score>] [-s <maxSize>] <source> <dest>" << std::endl
-              << "-f: Set score filter" << std::endl
-              << "-s: Set max number of prediction per word" << std::endl
+              << " [-f <score>] [-g <score>] [-s <maxSize>] <source> <dest>"
+              << std::endl
+              << "-f: Set score filter of bigram, on the score of both words"
+              << std::endl
+              << "-g: Set score filter of trigram, on the score of the last "
+                 "word after the other two"
+              << std::endl
+              << "-s: Set max number of prediction per context" << std::endl
               << "-h: Show this help" << std::endl;
 }
 
-float score(const libime::LanguageModel &model, std::string_view w,
-            std::string_view w2) {
-    auto state = model.nullState();
-    return model.wordsScore(state, std::vector<std::string_view>{w, w2});
+// Return the score of the last word after the others, and the score of all
+// the words.
+std::pair<float, float> score(const libime::LanguageModel &model,
+                              const std::vector<std::string> &words) {
+    libime::State state = model.nullState(), outState;
+    float s = 0, last = 0;
+    for (const auto &word : words) {
+        libime::WordNode node(word, model.index(word));
+        last = model.score(state, node, outState);
+        s += last;
+        state = outState;
+    }
+    return {last, s};
 }
 
 int main(int argc, char *argv[]) {
@@ -37,11 +52,15 @@ int main(int argc, char *argv[]) {
     float filter =
         std::log10(libime::DEFAULT_LANGUAGE_MODEL_UNKNOWN_PROBABILITY_PENALTY) +
         1;
-    while ((c = getopt(argc, argv, "f:s:h")) != -1) {
+    float trigramFilter = filter;
+    while ((c = getopt(argc, argv, "f:g:s:h")) != -1) {
         switch (c) {
         case 'f':
             filter = std::stof(optarg);
             break;
+        case 'g':
+            trigramFilter = std::stof(optarg);
+            break;
         case 's':
             maxSize = std::stoul(optarg);
             break;
@@ -56,7 +75,7 @@ int main(int argc, char *argv[]) {
 
     using namespace libime;
     LanguageModel model(argv[optind]);
-    DATrie<float> trie;
+    PredictionTable table;
 
     std::ifstream fin;
     std::istream *in;
@@ -79,12 +98,19 @@ int main(int argc, char *argv[]) {
 
         boost::trim_if(line, isSpaceCheck);
 
+        // Use bigram and trigram, so prediction can be looked up by the last
+        // two words.
         if (line == "\\2-grams:") {
             grams = 2;
             continue;
         }
 
         if (line == "\\3-grams:") {
+            grams = 3;
+            continue;
+        }
+
+        if (line == "\\4-grams:") {
             break;
         }
 
@@ -97,38 +123,31 @@ int main(int argc, char *argv[]) {
         if (tokens.size() < static_cast<size_t>(grams) + 1) {
             continue;
         }
-        // We don't want prediction generate <unk>
-        if (std::find(tokens.begin() + 1, tokens.end(), "<unk>") !=
-            tokens.end()) {
+        // We don't want prediction generate <unk>, but it is fine to have it
+        // as context.
+        if (tokens[grams] == "<unk>") {
             continue;
         }
 
-        auto s = score(model, tokens[grams - 1], tokens[grams]);
-        if (s > filter) {
-            word[tokens[grams - 1]][tokens[grams]] = s;
+        std::vector<std::string> words(tokens.begin() + 1,
+                                       tokens.begin() + grams + 1);
+        auto s = score(model, words);
+        // The joint score of a trigram is always lower than its bigram, so
+        // filter trigram by how likely the word is after its context.
+        if (grams == 2 ? s.second > filter : s.first > trigramFilter) {
+            words.pop_back();
+            word[boost::join(words, "|")][tokens[grams]] = s.first;
         }
     }
 
     for (auto &p : word) {
-        std::vector<std::pair<std::string, float>> result(p.second.begin(),
-                                                          p.second.end());
-        std::sort(result.begin(), result.end(),
-                  [](const auto &lhs, const auto &rhs) {
-                      if (lhs.second != rhs.second) {
-                          return lhs.second > rhs.second;
-                      }
-                      return lhs.first < rhs.first;
-                  });
-        if (result.size() > maxSize) {
-            result.resize(maxSize);
-        }
-        for (auto &p2 : result) {
-            trie.set(p.first + "|" + p2.first, p2.second);
-        }
+        table.set(p.first,
+                  PredictionTable::CandidateList(p.second.begin(),
+                                                 p.second.end()),
+                  maxSize);
     }
 
-    FCITX_LOG(Info) << "Memory: " << trie.mem_size()
-                    << " Number of entries: " << trie.size();
+    FCITX_LOG(Info) << "Number of contexts: " << table.size();
 
     std::ofstream fout;
     std::ostream *out;
@@ -138,6 +157,6 @@ int main(int argc, char *argv[]) {
         fout.open(argv[optind + 2], std::ios::out | std::ios::binary);
         out = &fout;
     }
-    trie.save(*out);
+    table.save(*out);
     return 0;
 }